@@ -1,6 +1,6 @@
 /*
 	QuickFuck library, a lightweight C++ Brainfuck interpreter library
-	Currently has Brainfuck::DynamicInterpreter and Brainfuck::PerformanceInterpreter
+	Currently has Brainfuck::DynamicInterpreter, Brainfuck::PerformanceInterpreter and Brainfuck::CompiledInterpreter
 	This is the library version, designed to be used in other programs
 	By Robonics
 */
@@ -11,8 +11,149 @@
 #include <fstream>
 #include <sstream>
 #include <math.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <array>
+#include <limits>
+#include <chrono>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define QUICKFUCK_X86
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define QUICKFUCK_MMAP
+#endif
 
 namespace Brainfuck {
+	/// Why running stopped, for the run() and tryStep() that report it instead of throwing
+	enum class Status : unsigned char {
+		Ok,          ///< Reached the end of the program, or finished the step
+		NeedInput,   ///< At a ',' with no input left, which runs again once there is more
+		OutOfBounds, ///< The pointer would have gone off the end of the tape
+		Budget,      ///< Ran as many steps as it was allowed to
+		Breakpoint,  ///< The debug hook asked to stop at a '#', and running again carries on after it
+		Cancelled    ///< The CancellationToken was cancelled, and running again carries on once it is reset
+	};
+
+	/// Lets another thread stop a running interpreter, which checks it each time it goes back round a loop
+	class CancellationToken {
+		std::atomic<bool> cancelled{false};
+	public:
+		/// Safe to call from any thread, or a signal handler
+		void cancel() {
+			cancelled.store(true, std::memory_order_relaxed);
+		}
+		void reset() {
+			cancelled.store(false, std::memory_order_relaxed);
+		}
+		bool isCancelled() const {
+			return cancelled.load(std::memory_order_relaxed);
+		}
+	};
+
+	/// Where a running interpreter has got to, published every so often so other threads can read it while it runs
+	/// It is a seqlock, so the interpreter never waits for readers, and readers only retry if they overlap a write
+	class Progress {
+	public:
+		/// How many cells around the pointer each snapshot has
+		static const size_t window = 64;
+
+		struct Snapshot {
+			size_t position = 0;
+			size_t index = 0;
+			/// Counted since the record was given to the interpreter, in instructions for the compiled interpreter
+			uint64_t steps = 0;
+			/// The cells from start to start + count, which include the pointer's cell
+			size_t start = 0;
+			size_t count = 0;
+			std::array<char, window> cells = {};
+		};
+
+	private:
+		/// Odd while a write is under way
+		std::atomic<uint64_t> sequence{0};
+		std::atomic<size_t> position{0};
+		std::atomic<size_t> index{0};
+		std::atomic<uint64_t> steps{0};
+		std::atomic<size_t> start{0};
+		std::atomic<size_t> count{0};
+		/// The window, a word at a time
+		std::array<std::atomic<uint64_t>, window / 8> cells;
+		size_t interval;
+
+	public:
+		/// @param every How many steps to run between publishing
+		explicit Progress( size_t every = 65536 ) : interval(every > 0? every : 1) {
+			for( std::atomic<uint64_t>& c : cells ) {
+				c.store(0, std::memory_order_relaxed);
+			}
+		}
+		size_t getInterval() const {
+			return interval;
+		}
+
+		/// Only called by the thread running the interpreter
+		void publish( const Snapshot& s ) {
+			uint64_t seq = sequence.load(std::memory_order_relaxed);
+			sequence.store(seq + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			position.store(s.position, std::memory_order_relaxed);
+			index.store(s.index, std::memory_order_relaxed);
+			steps.store(s.steps, std::memory_order_relaxed);
+			start.store(s.start, std::memory_order_relaxed);
+			count.store(s.count, std::memory_order_relaxed);
+			for( size_t i = 0; i < cells.size(); i++ ) {
+				uint64_t word;
+				memcpy(&word, s.cells.data() + i * 8, 8);
+				cells[i].store(word, std::memory_order_relaxed);
+			}
+			sequence.store(seq + 2, std::memory_order_release);
+		}
+
+		/// The last snapshot published, from any thread, without holding up the interpreter
+		Snapshot read() const {
+			Snapshot s;
+			while( true ) {
+				uint64_t before = sequence.load(std::memory_order_acquire);
+				if( before & 1 ) {
+					continue;
+				}
+				s.position = position.load(std::memory_order_relaxed);
+				s.index = index.load(std::memory_order_relaxed);
+				s.steps = steps.load(std::memory_order_relaxed);
+				s.start = start.load(std::memory_order_relaxed);
+				s.count = count.load(std::memory_order_relaxed);
+				for( size_t i = 0; i < cells.size(); i++ ) {
+					uint64_t word = cells[i].load(std::memory_order_relaxed);
+					memcpy(s.cells.data() + i * 8, &word, 8);
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if( sequence.load(std::memory_order_relaxed) == before ) {
+					return s;
+				}
+			}
+		}
+	};
+
+	class Interpreter;
+	/// Called at each '#' in the code, with the interpreter stopped there
+	/// @return Whether to stop running, with Status::Breakpoint
+	typedef std::function<bool( Interpreter& )> DebugHook;
+
 	/// Base/Abstract class
 	class Interpreter {
 	protected:
@@ -23,15 +164,96 @@ namespace Brainfuck {
 		size_t position;
 		size_t active_cell = 0;
 		std::stack<size_t> loops;
+		/// Empty unless setDebugHook() has been given one, in which case '#' calls it
+		DebugHook hook;
+		/// Empty unless setCancellationToken() has been given one
+		std::shared_ptr<CancellationToken> token;
+		/// Empty unless setProgress() has been given one
+		std::shared_ptr<Progress> progress;
+		/// Steps counted up to the last publish, and how many more until the next one
+		uint64_t steps = 0;
+		size_t countdown = 0;
+
+		/// Count a step, and publish the progress every so often if anyone is watching
+		void tick() {
+			if( progress && --countdown == 0 ) {
+				this->publish();
+			}
+		}
+		void publish() {
+			steps += progress->getInterval() - countdown;
+			countdown = progress->getInterval();
+			Progress::Snapshot s;
+			s.position = position;
+			s.index = active_cell;
+			s.steps = steps;
+			size_t size = this->getSize();
+			const size_t window = Progress::window;
+			s.start = active_cell > window / 2? active_cell - window / 2 : 0;
+			s.start = std::min(s.start, size > window? size - window : 0);
+			s.count = std::min(window, size - s.start);
+			const char* data = this->getTapeData();
+			for( size_t i = 0; i < s.count; i++ ) {
+				s.cells[i] = data? data[s.start + i] : this->getValue(s.start + i);
+			}
+			progress->publish(s);
+		}
+		/// For run() to return through, so the progress is up to date once it stops
+		Status stopped( Status s ) {
+			if( progress ) {
+				this->publish();
+			}
+			return s;
+		}
+
+		/// The exceptions thrown by interpret() and step(), which predate Status
+		static void raise( Status s ) {
+			switch( s ) {
+				case Status::NeedInput:
+					throw std::range_error("Input is empty, nothing more to read");
+				case Status::OutOfBounds:
+					throw std::range_error("The pointer would go off the end of the tape");
+				case Status::Cancelled:
+					throw std::runtime_error("Execution was cancelled");
+				default:
+					break;
+			}
+		}
 	public:
+		/// A budget for run() that never runs out
+		static const size_t unlimited = (size_t)-1;
 
 		Interpreter() {}
-		Interpreter( std::string c ) : code(c) {}
+		Interpreter( std::string c ) : code(std::move(c)) {}
+		virtual ~Interpreter() {}
 
 		virtual std::string interpret() {return output;}
 		virtual std::string interpret(std::string) {return output;}
 		virtual void reset() {}
 		virtual void step() {}
+		/// Run from the current position until the program ends or something stops it, without throwing
+		/// @param budget How many steps to run at most
+		virtual Status run( size_t budget = unlimited ) {(void)budget; return Status::Ok;}
+		/// Execute a single step, without throwing
+		virtual Status tryStep() {return Status::Ok;}
+
+		/// Call hook at every '#', or ignore them again if it is empty, which is the default
+		/// Building with QUICKFUCK_NO_DEBUG_HOOK takes '#' out of every engine, so the hook is never called
+		virtual void setDebugHook( DebugHook h ) {
+			hook = h;
+		}
+		/// Stop with Status::Cancelled at the end of a loop once t is cancelled, or never if it is empty, which is the default
+		/// Set it before running, and cancel() it from wherever
+		virtual void setCancellationToken( std::shared_ptr<CancellationToken> t ) {
+			token = t;
+		}
+		/// Publish where the interpreter has got to in p every p->getInterval() steps, and whenever run() returns
+		/// Set it before running, and read() it from wherever
+		void setProgress( std::shared_ptr<Progress> p ) {
+			progress = p;
+			steps = 0;
+			countdown = p? p->getInterval() : 0;
+		}
 		std::string getOutput() {
 			return output;
 		}
@@ -47,7 +269,7 @@ namespace Brainfuck {
 		void addInput( std::string s ) {
 			input += s;
 		}
-		std::string& getCode() {
+		virtual std::string& getCode() {
 			return code;
 		}
 		size_t getPosition() {
@@ -68,6 +290,35 @@ namespace Brainfuck {
 		virtual void setValue(size_t,char) {}
 		virtual void setValue(char) {}
 		virtual size_t getSize() {return 0;}
+		/// Copy n bytes onto the start of the tape in one go, growing it if the interpreter can
+		/// @return Status::OutOfBounds if they don't fit, leaving the tape as it was
+		virtual Status setTape( const char*, size_t ) {return Status::OutOfBounds;}
+		/// All getSize() cells in one block, for reading the tape out without copying it
+		/// @return nullptr if the interpreter's cells aren't bytes
+		virtual const char* getTapeData() {return nullptr;}
+		/// Read a cell without throwing
+		/// @return Status::OutOfBounds if there is no cell i
+		Status getValue( size_t i, char& v ) {
+			if( i >= this->getSize() ) {
+				return Status::OutOfBounds;
+			}
+			v = this->getValue(i);
+			return Status::Ok;
+		}
+
+		/// Find the ']' matching the '[' at position i
+		/// @return The position of the matching ']', or the length of the code if there is none
+		static size_t skipLoop( const std::string& code, size_t i ) {
+			size_t depth = 0;
+			for( ; i < code.length(); i++ ) {
+				if( code[i] == '[' ) {
+					depth++;
+				}else if( code[i] == ']' && --depth == 0 ) {
+					return i;
+				}
+			}
+			return code.length();
+		}
 	};
 
 	/// The most basic interpreter. Rather memory hefty, does not support negative cell coords
@@ -102,28 +353,44 @@ namespace Brainfuck {
 		/// Interpret the code from the beginning
 		virtual std::string interpret() {
 			this->reset();
-			while( position < code.length() ) {
-				this->step();
-			}
+			raise(this->run());
 			return output;
 		}
 		virtual std::string interpret( std::string in ) {
-			this->input = in;
 			this->reset();
-			while( position < code.length() ) {
-				this->step();
-			}
+			this->input = in;
+			raise(this->run());
 			return output;
 		}
 
 		virtual void reset() {
 			position = 0;
+			active_cell = 0;
 			cells = { 0 };
+			loops = {};
 			output = "";
 			input = "";
 		}
 
+		virtual Status run( size_t budget = unlimited ) {
+			for( ; position < code.length(); budget-- ) {
+				if( budget == 0 ) {
+					return this->stopped(Status::Budget);
+				}
+				Status s = this->tryStep();
+				if( s != Status::Ok ) {
+					return this->stopped(s);
+				}
+				this->tick();
+			}
+			return this->stopped(Status::Ok);
+		}
+
 		virtual void step() {
+			raise(this->tryStep());
+		}
+
+		virtual Status tryStep() {
 			switch( code[position] ) {
 				case '+':
 					cells[active_cell]++;
@@ -141,13 +408,21 @@ namespace Brainfuck {
 					active_cell++;
 					break;
 				case '[':
-					loops.push(position);
+					if( cells[active_cell] == 0 ) {
+						position = skipLoop(code, position);
+					}else {
+						loops.push(position);
+					}
 					break;
 				case ']':
 					if( cells[active_cell] == 0 ) {
 						loops.pop();
 					}else {
 						position = loops.top();
+						if( token && token->isCancelled() ) {
+							position++;
+							return Status::Cancelled;
+						}
 					}
 					break;
 				case '.':
@@ -155,13 +430,22 @@ namespace Brainfuck {
 					break;
 				case ',':
 					if( input.length() == 0 ) {
-						throw std::range_error("End of input");
+						return Status::NeedInput;
 					}
 					cells[active_cell] = input[0];
 					input.erase(0, 1);
 					break;
+#ifndef QUICKFUCK_NO_DEBUG_HOOK
+				case '#':
+					if( hook && hook(*this) ) {
+						position++;
+						return Status::Breakpoint;
+					}
+					break;
+#endif
 			}
 			position++;
+			return Status::Ok;
 		}
 
 		/// Print the value of all the cells
@@ -169,11 +453,12 @@ namespace Brainfuck {
 			return cells;
 		}
 		virtual char getValue(size_t i) {
-			if(i > cells.size()) {
+			if(i >= cells.size()) {
 				throw std::range_error("Out of bounds");
 			}
 			return cells[i];
 		}
+		using Interpreter::getValue;
 		virtual char getValue() {
 			return cells[active_cell];
 		}
@@ -186,13 +471,27 @@ namespace Brainfuck {
 		virtual size_t getSize() {
 			return cells.size();
 		}
+		virtual Status setTape( const char* data, size_t n ) {
+			if( n > cells.size() ) {
+				cells.resize(n);
+			}
+			memcpy(cells.data(), data, n);
+			return Status::Ok;
+		}
+		virtual const char* getTapeData() {
+			return cells.data();
+		}
 	};
 
 	/// This is the "performance" version of the interpreter, in that it uses marginally less memory
 	/// This is not dynamically sized, nor does it support negative cell keys
 	class PerformanceInterpreter : public Interpreter {
+	protected:
 		unsigned char* bytes;
 		size_t size;
+
+		/// For subclasses that provide the tape themselves, and take care of clearing it in reset()
+		PerformanceInterpreter( std::string s, unsigned char* tape, size_t width ) : Interpreter(s), bytes(tape), size(width) {}
 	public:
 		/// @param s The source code to build from
 		/// @param width The width/length of the tape
@@ -213,23 +512,23 @@ namespace Brainfuck {
 			buff << f.rdbuf();
 			this->code = buff.str();
 		}
+		PerformanceInterpreter( const PerformanceInterpreter& ) = delete;
+		PerformanceInterpreter& operator=( const PerformanceInterpreter& ) = delete;
+		/// Subclasses that provide the tape themselves set bytes to nullptr before this runs
+		virtual ~PerformanceInterpreter() {
+			free(bytes);
+		}
 
 		/// Interprets the code form position 0
 		virtual std::string interpret() {
 			this->reset();
-
-			while( position < code.length() ) {
-				this->step();
-			}
+			raise(this->run());
 			return output;
 		}
 		virtual std::string interpret(std::string in) {
-			input = in;
 			this->reset();
-
-			while( position < code.length() ) {
-				this->step();
-			}
+			input = in;
+			raise(this->run());
 			return output;
 		}
 
@@ -243,11 +542,30 @@ namespace Brainfuck {
 				bytes[i] = 0;
 			}
 
+			loops = {};
 			output = "";
 			input = "";
 		}
 
+		virtual Status run( size_t budget = unlimited ) {
+			for( ; position < code.length(); budget-- ) {
+				if( budget == 0 ) {
+					return this->stopped(Status::Budget);
+				}
+				Status s = this->tryStep();
+				if( s != Status::Ok ) {
+					return this->stopped(s);
+				}
+				this->tick();
+			}
+			return this->stopped(Status::Ok);
+		}
+
 		virtual void step() {
+			raise(this->tryStep());
+		}
+
+		virtual Status tryStep() {
 			switch(code[position]) {
 				case '+':
 					bytes[active_cell]++;
@@ -255,20 +573,34 @@ namespace Brainfuck {
 				case '-':
 					bytes[active_cell]--;
 					break;
-				case '<': // This version has no hand holds
+				case '<':
+					if(active_cell == 0) {
+						return Status::OutOfBounds;
+					}
 					active_cell--;
 					break;
 				case '>':
+					if(active_cell + 1 == size) {
+						return Status::OutOfBounds;
+					}
 					active_cell++;
 					break;
 				case '[':
-					loops.push(position);
+					if(bytes[active_cell] == 0) {
+						position = skipLoop(code, position);
+					}else {
+						loops.push(position);
+					}
 					break;
 				case ']':
 					if(bytes[active_cell] == 0) {
 						loops.pop();
 					}else {
 						position = loops.top();
+						if(token && token->isCancelled()) {
+							position++;
+							return Status::Cancelled;
+						}
 					}
 					break;
 				case '.':
@@ -276,12 +608,22 @@ namespace Brainfuck {
 					break;
 				case ',':
 					if(input.length() == 0) {
-						throw std::range_error("Input is empty, nothing more to read");
+						return Status::NeedInput;
 					}
 					bytes[active_cell] = input[0];
 					input.erase(0,1);
+					break;
+#ifndef QUICKFUCK_NO_DEBUG_HOOK
+				case '#':
+					if(hook && hook(*this)) {
+						position++;
+						return Status::Breakpoint;
+					}
+					break;
+#endif
 			}
 			position++;
+			return Status::Ok;
 		}
 
 		// Prints the contents of each cell
@@ -298,6 +640,7 @@ namespace Brainfuck {
 		virtual char getValue(size_t i) {
 			return (char)bytes[i];
 		}
+		using Interpreter::getValue;
 		virtual char getValue() {
 			return (char)bytes[active_cell];
 		}
@@ -310,5 +653,3342 @@ namespace Brainfuck {
 		virtual size_t getSize() {
 			return size;
 		}
+		virtual Status setTape( const char* data, size_t n ) {
+			if( n > size ) {
+				return Status::OutOfBounds;
+			}
+			memcpy(bytes, data, n);
+			return Status::Ok;
+		}
+		virtual const char* getTapeData() {
+			return (const char*)bytes;
+		}
+	};
+
+	/// A performance interpreter whose tape wraps around, so '<' on the first cell goes to the last one and '>' on the last goes to the first
+	/// The size is rounded up to a power of two, so wrapping is a mask instead of a check
+	class RingInterpreter : public PerformanceInterpreter {
+		size_t mask;
+
+		static size_t round( size_t width ) {
+			size_t n = 1;
+			while( n < width ) {
+				n <<= 1;
+			}
+			return n;
+		}
+
+	public:
+		/// @param s The source code to build from
+		/// @param width The smallest width/length of the tape, which is rounded up to a power of two
+		RingInterpreter( std::string s, size_t width ) : PerformanceInterpreter(s, round(width)), mask(round(width) - 1) {}
+
+		virtual Status tryStep() {
+			switch( code[position] ) {
+				case '<':
+					active_cell = (active_cell - 1) & mask;
+					break;
+				case '>':
+					active_cell = (active_cell + 1) & mask;
+					break;
+				default:
+					return PerformanceInterpreter::tryStep();
+			}
+			position++;
+			return Status::Ok;
+		}
+	};
+
+	/// Runs Boolfuck, where every cell is a single bit, packed 64 to a word
+	/// '+' flips the cell, ',' reads the next bit of input and ';' outputs one, least significant bit of each byte first.
+	/// '-' and '.' are comments, as in Boolfuck. Output that doesn't fill a byte is padded with zeros once the program ends.
+	/// Scans like [>] and [<] go through the tape a word at a time
+	class BitInterpreter : public Interpreter {
+		std::vector<uint64_t> words;
+		/// In cells, so bits
+		size_t size;
+		/// Bits of input already read from the first character, and output waiting for a whole byte
+		unsigned in_bits = 0;
+		unsigned out_bits = 0;
+		unsigned char out_byte = 0;
+
+		bool bit( size_t i ) {
+			return (words[i >> 6] >> (i & 63)) & 1;
+		}
+
+		/// The index of the lowest and highest set bits, of a word that isn't zero
+		static unsigned lowest( uint64_t x ) {
+#ifdef __GNUC__
+			return __builtin_ctzll(x);
+#else
+			unsigned i = 0;
+			for( ; !(x & 1); x >>= 1 )
+				i++;
+			return i;
+#endif
+		}
+		static unsigned highest( uint64_t x ) {
+#ifdef __GNUC__
+			return 63 - __builtin_clzll(x);
+#else
+			unsigned i = 0;
+			for( ; x >>= 1; )
+				i++;
+			return i;
+#endif
+		}
+
+		/// Move to the first zero cell from the pointer upwards, for [>]
+		/// @return false if there isn't one before the end of the tape, leaving the pointer on the last cell
+		bool scanUp() {
+			size_t w = active_cell >> 6;
+			uint64_t zeros = ~words[w] & (~0ull << (active_cell & 63));
+			while( !zeros ) {
+				if( ++w == words.size() ) {
+					active_cell = size - 1;
+					return false;
+				}
+				zeros = ~words[w];
+			}
+			// The bits past the end of the tape are always zero, so they need checking for
+			size_t found = (w << 6) + lowest(zeros);
+			active_cell = std::min(found, size - 1);
+			return found < size;
+		}
+		/// Move to the first zero cell from the pointer downwards, for [<]
+		/// @return false if there isn't one, leaving the pointer on the first cell
+		bool scanDown() {
+			size_t w = active_cell >> 6;
+			uint64_t zeros = ~words[w] & (~0ull >> (63 - (active_cell & 63)));
+			while( !zeros ) {
+				if( w == 0 ) {
+					active_cell = 0;
+					return false;
+				}
+				zeros = ~words[--w];
+			}
+			active_cell = (w << 6) + highest(zeros);
+			return true;
+		}
+
+	public:
+		/// @param s The source code to build from
+		/// @param width The width/length of the tape, in bits
+		BitInterpreter( std::string s, size_t width ) : Interpreter(s), words((width + 63) / 64, 0), size(width) {}
+
+		/// Interprets the code from the start
+		virtual std::string interpret() {
+			this->reset();
+			raise(this->run());
+			return output;
+		}
+		virtual std::string interpret( std::string in ) {
+			this->reset();
+			input = in;
+			raise(this->run());
+			return output;
+		}
+
+		virtual void reset() {
+			position = 0;
+			active_cell = 0;
+			words.assign(words.size(), 0);
+			in_bits = 0;
+			out_bits = 0;
+			out_byte = 0;
+			loops = {};
+			output = "";
+			input = "";
+		}
+
+		virtual Status run( size_t budget = unlimited ) {
+			for( ; position < code.length(); budget-- ) {
+				if( budget == 0 ) {
+					return this->stopped(Status::Budget);
+				}
+				Status s = this->tryStep();
+				if( s != Status::Ok ) {
+					return this->stopped(s);
+				}
+				this->tick();
+			}
+			return this->stopped(Status::Ok);
+		}
+
+		virtual void step() {
+			raise(this->tryStep());
+		}
+
+		virtual Status tryStep() {
+			switch( code[position] ) {
+				case '+':
+					words[active_cell >> 6] ^= 1ull << (active_cell & 63);
+					break;
+				case '<':
+					if( active_cell == 0 ) {
+						return Status::OutOfBounds;
+					}
+					active_cell--;
+					break;
+				case '>':
+					if( active_cell + 1 == size ) {
+						return Status::OutOfBounds;
+					}
+					active_cell++;
+					break;
+				case '[':
+					if( !this->bit(active_cell) ) {
+						position = skipLoop(code, position);
+					}else if( code.compare(position, 3, "[>]") == 0 ) {
+						if( !this->scanUp() ) {
+							// Stopped on the '>' that would go off the end, inside the loop as the other engines leave it
+							loops.push(position);
+							position++;
+							return Status::OutOfBounds;
+						}
+						position += 2;
+					}else if( code.compare(position, 3, "[<]") == 0 ) {
+						if( !this->scanDown() ) {
+							loops.push(position);
+							position++;
+							return Status::OutOfBounds;
+						}
+						position += 2;
+					}else {
+						loops.push(position);
+					}
+					break;
+				case ']':
+					if( !this->bit(active_cell) ) {
+						loops.pop();
+					}else {
+						position = loops.top();
+						if( token && token->isCancelled() ) {
+							position++;
+							return Status::Cancelled;
+						}
+					}
+					break;
+				case ';':
+					out_byte |= this->bit(active_cell) << out_bits;
+					if( ++out_bits == 8 ) {
+						output += (char)out_byte;
+						out_byte = 0;
+						out_bits = 0;
+					}
+					break;
+				case ',':
+					if( input.length() == 0 ) {
+						return Status::NeedInput;
+					}
+					if( (((unsigned char)input[0] >> in_bits) & 1) != this->bit(active_cell) ) {
+						words[active_cell >> 6] ^= 1ull << (active_cell & 63);
+					}
+					if( ++in_bits == 8 ) {
+						input.erase(0, 1);
+						in_bits = 0;
+					}
+					break;
+#ifndef QUICKFUCK_NO_DEBUG_HOOK
+				case '#':
+					if( hook && hook(*this) ) {
+						position++;
+						return Status::Breakpoint;
+					}
+					break;
+#endif
+			}
+			position++;
+			if( position >= code.length() && out_bits > 0 ) {
+				output += (char)out_byte;
+				out_byte = 0;
+				out_bits = 0;
+			}
+			return Status::Ok;
+		}
+
+		/// One char of 0 or 1 for each bit
+		virtual std::vector<char> getTape() {
+			std::vector<char> v(size);
+			for( size_t i = 0; i < size; i++ ) {
+				v[i] = this->bit(i);
+			}
+			return v;
+		}
+		virtual char getValue(size_t i) {
+			if(i >= size) {
+				throw std::range_error("Out of bounds");
+			}
+			return this->bit(i);
+		}
+		using Interpreter::getValue;
+		virtual char getValue() {
+			return this->bit(active_cell);
+		}
+		/// Sets the cell to the lowest bit of v
+		virtual void setValue(size_t i, char v) {
+			words[i >> 6] = (words[i >> 6] & ~(1ull << (i & 63))) | ((uint64_t)(v & 1) << (i & 63));
+		}
+		virtual void setValue(char v) {
+			this->setValue(active_cell, v);
+		}
+		virtual size_t getSize() {
+			return size;
+		}
+		/// Takes the lowest bit of each byte
+		virtual Status setTape( const char* data, size_t n ) {
+			if( n > size ) {
+				return Status::OutOfBounds;
+			}
+			for( size_t i = 0; i < n; i++ ) {
+				this->setValue(i, data[i]);
+			}
+			return Status::Ok;
+		}
+		/// The cells aren't bytes, so there isn't a block of them to read
+		virtual const char* getTapeData() {
+			return nullptr;
+		}
+	};
+
+#ifdef QUICKFUCK_MMAP
+	/// A performance interpreter whose tape lives in a file, mapped into memory
+	/// The tape can be far bigger than RAM, since the file starts out sparse and the kernel pages it in and out as the pointer moves.
+	/// checkpoint() saves where the program is along with the tape, so a later process can resume() from there.
+	/// The mapping is private, so changes only reach the file at a checkpoint, and they get there through a journal next to it:
+	/// a process that dies at any point leaves the file as one checkpoint or the next, never a mix of the two
+	class MappedInterpreter : public PerformanceInterpreter {
+		/// Stored at the start of the file, a page ahead of the tape
+		struct Header {
+			char magic[8];
+			uint64_t size;
+			/// Of the code that saved the checkpoint, so another program doesn't carry on from it
+			uint64_t code;
+			uint64_t position;
+			uint64_t active_cell;
+			/// Whether position and active_cell have been saved since the tape was last cleared
+			uint64_t saved;
+		};
+		/// Starts the journal, and is only written once everything after it has reached the disk
+		struct Commit {
+			char magic[8];
+			uint64_t records;
+		};
+		/// Followed in the journal by length bytes to write to the file at offset
+		struct Record {
+			uint64_t offset;
+			uint64_t length;
+		};
+		static const size_t header_size = 4096;
+		/// Changes are tracked a page at a time, which header_size keeps in line with the file's pages
+		static const size_t page = 4096;
+		/// The pointer gets the kernel to read ahead a window of this many cells at a time
+		static const size_t window = (size_t)1 << 20;
+#ifdef MAP_NORESERVE
+		/// Only the pages written between checkpoints need memory of their own, so none is set aside for the rest
+		static const int private_map = MAP_PRIVATE | MAP_NORESERVE;
+#else
+		static const int private_map = MAP_PRIVATE;
+#endif
+
+		std::string path;
+		int fd = -1;
+		Header* header = nullptr;
+		/// Pages of the tape changed since the last checkpoint, which are only in this process's memory until then
+		std::set<size_t> dirty;
+		/// The last page added to dirty, so runs of changes to the same page skip the set
+		size_t last_dirty = (size_t)-1;
+		/// Set when a checkpoint was committed to the journal but not all written to the file
+		bool unfinished = false;
+		size_t last_window = 0;
+		bool forwards = true;
+
+		/// Open and map the file, creating or growing it to fit the tape, after finishing any checkpoint that was cut short
+		/// @param clear Whether to empty the tape and throw away the last checkpoint
+		/// @throws std::runtime_error if it can't be opened or mapped, or holds a different size of tape
+		void map( bool clear ) {
+			fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if( fd < 0 ) {
+				throw std::runtime_error("Could not open " + path);
+			}
+			auto fail = [this]( const std::string& message ) {
+				close(fd);
+				fd = -1;
+				throw std::runtime_error(message);
+			};
+			try {
+				this->recover(clear);
+			}catch( std::runtime_error& e ) {
+				fail(e.what());
+			}
+			struct stat info;
+			Header saved;
+			size_t length = header_size + size;
+			if( fstat(fd, &info) != 0 ) {
+				fail("Could not open " + path);
+			}
+			// Only a file that was just created or is empty is taken as a new tape, anything else has to already hold one
+			bool fresh = clear || info.st_size == 0;
+			if( fresh ) {
+				memset(&saved, 0, sizeof(Header));
+				memcpy(saved.magic, "QFTAPE1", 8);
+				saved.size = size;
+			}else if( pread(fd, &saved, sizeof(Header), 0) != (ssize_t)sizeof(Header) ) {
+				memset(&saved, 0, sizeof(Header));
+			}
+			if( memcmp(saved.magic, "QFTAPE1", 8) != 0 || saved.size != size || (!fresh && (size_t)info.st_size < length) ) {
+				fail(path + " does not hold a tape of " + std::to_string(size) + " cells");
+			}
+			// Truncating first punches out the old tape, so clearing it doesn't have to write every cell
+			if( fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0 || pwrite(fd, &saved, sizeof(Header), 0) != (ssize_t)sizeof(Header)) ) {
+				fail("Could not make " + path + " big enough for the tape");
+			}
+			void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, private_map, fd, 0);
+			if( data == MAP_FAILED ) {
+				fail("Could not map " + path);
+			}
+			madvise(data, length, MADV_SEQUENTIAL);
+			header = (Header*)data;
+			bytes = (unsigned char*)data + header_size;
+			dirty.clear();
+			last_dirty = (size_t)-1;
+		}
+		/// Safe to call again, or after map() has thrown
+		void unmap() {
+			if( header ) {
+				munmap(header, header_size + size);
+			}
+			if( fd >= 0 ) {
+				close(fd);
+			}
+			header = nullptr;
+			bytes = nullptr;
+			fd = -1;
+		}
+
+		/// Write out a checkpoint the journal holds in full, or throw away one that was cut short before it was
+		/// @throws std::runtime_error if a complete journal can't be written to the file
+		void recover( bool clear ) {
+			int journal = open((path + ".journal").c_str(), O_RDWR);
+			if( journal < 0 ) {
+				return;
+			}
+			Commit commit;
+			bool complete = !clear && pread(journal, &commit, sizeof(Commit), 0) == (ssize_t)sizeof(Commit) && memcmp(commit.magic, "QFJRNL1", 8) == 0;
+			off_t at = sizeof(Commit);
+			std::vector<char> data;
+			for( uint64_t r = 0; complete && r < commit.records; r++ ) {
+				Record record;
+				bool ok = pread(journal, &record, sizeof(Record), at) == (ssize_t)sizeof(Record);
+				if( ok ) {
+					data.resize(record.length);
+					ok = pread(journal, data.data(), record.length, at + sizeof(Record)) == (ssize_t)record.length
+						&& pwrite(fd, data.data(), record.length, record.offset) == (ssize_t)record.length;
+				}
+				if( !ok ) {
+					close(journal);
+					throw std::runtime_error("Could not finish the checkpoint in " + path + ".journal");
+				}
+				at += sizeof(Record) + record.length;
+			}
+			// Writing it again is harmless, so the journal only has to be emptied once the file has it all
+			if( (complete && fsync(fd) != 0) || ftruncate(journal, 0) != 0 || fsync(journal) != 0 ) {
+				close(journal);
+				throw std::runtime_error("Could not finish the checkpoint in " + path + ".journal");
+			}
+			close(journal);
+		}
+
+		/// Map pages of the file again, dropping this process's copies of them
+		void reload( uint64_t offset, uint64_t length ) {
+			mmap((char*)header + offset, length, PROT_READ | PROT_WRITE, private_map | MAP_FIXED, fd, offset);
+		}
+
+		/// How many cells of the tape are in page p, which is only fewer than a page for the last one
+		size_t pageLength( size_t p ) {
+			return size - p * page < page? size - p * page : page;
+		}
+
+		/// Remember that cells from i to i + n - 1 have changed, so the next checkpoint saves them
+		void touch( size_t i, size_t n = 1 ) {
+			if( n == 0 || i >= size ) {
+				return;
+			}
+			size_t last = std::min(i + n, size) - 1;
+			for( size_t p = i / page; p <= last / page; p++ ) {
+				if( p != last_dirty ) {
+					dirty.insert(p);
+					last_dirty = p;
+				}
+			}
+		}
+
+		/// FNV-1a, which unlike std::hash gives the same answer in every build
+		static uint64_t hash( const std::string& s ) {
+			uint64_t h = 14695981039346656037ull;
+			for( unsigned char c : s ) {
+				h = (h ^ c) * 1099511628211ull;
+			}
+			return h;
+		}
+
+		/// Tell the kernel which way the pointer is going when it moves into a new window
+		void advise() {
+			size_t w = active_cell / window;
+			if( w == last_window ) {
+				return;
+			}
+			bool up = w > last_window;
+			last_window = w;
+			if( up != forwards ) {
+				// Read ahead only helps going forwards
+				forwards = up;
+				madvise(header, header_size + size, up? MADV_SEQUENTIAL : MADV_NORMAL);
+			}
+			if( up && (w + 1) * window < size ) {
+				const size_t ahead = window; // std::min would need window defined outside the class
+				madvise(bytes + (w + 1) * window, std::min(ahead, size - (w + 1) * window), MADV_WILLNEED);
+			}else if( !up && w > 0 ) {
+				madvise(bytes + (w - 1) * window, window, MADV_WILLNEED);
+			}
+		}
+
+	public:
+		/// @param s The source code to build from
+		/// @param file The file to keep the tape in, which is created if it doesn't exist. The journal is kept in file.journal
+		/// @param width The width/length of the tape, which has to match the file if it already holds one
+		/// @throws std::runtime_error if the file can't be used
+		MappedInterpreter( std::string s, const std::string& file, size_t width ) : PerformanceInterpreter(s, nullptr, width), path(file) {
+			this->map(false);
+		}
+		MappedInterpreter( const MappedInterpreter& ) = delete;
+		MappedInterpreter& operator=( const MappedInterpreter& ) = delete;
+		/// Changes since the last checkpoint are thrown away
+		virtual ~MappedInterpreter() {
+			this->unmap();
+		}
+
+		/// Clears the tape, by emptying the file rather than writing zeros over it
+		/// @throws std::runtime_error if the file can't be mapped again
+		virtual void reset() {
+			this->unmap();
+			this->map(true);
+			position = 0;
+			active_cell = 0;
+			last_window = 0;
+			loops = {};
+			output = "";
+			input = "";
+		}
+
+		/// Carry on from the last checkpoint(), with the tape as it was then
+		/// Output and input are not saved, so output from before the checkpoint isn't repeated
+		/// @return false if there is no checkpoint of this code to carry on from, in which case nothing changes
+		/// @throws std::runtime_error if a checkpoint that failed part way through can't be finished
+		bool resume() {
+			if( unfinished ) {
+				this->recover(false);
+				unfinished = false;
+			}
+			// The header in memory has whatever a failed checkpoint() left in it, so it is read from the file
+			Header saved;
+			if( pread(fd, &saved, sizeof(Header), 0) != (ssize_t)sizeof(Header) || !saved.saved || saved.code != hash(code) ) {
+				return false;
+			}
+			// Anything changed since is dropped by mapping those pages from the file again
+			this->reload(0, header_size);
+			for( size_t p : dirty ) {
+				this->reload(header_size + p * page, this->pageLength(p));
+			}
+			dirty.clear();
+			last_dirty = (size_t)-1;
+			position = header->position;
+			active_cell = header->active_cell;
+			last_window = active_cell / window;
+			// The loops that were open are the unmatched '[' before the position
+			loops = {};
+			for( size_t i = 0; i < position && i < code.length(); i++ ) {
+				if( code[i] == '[' ) {
+					loops.push(i);
+				}else if( code[i] == ']' && !loops.empty() ) {
+					loops.pop();
+				}
+			}
+			output = "";
+			input = "";
+			return true;
+		}
+
+		/// Save where the program is and the pages of the tape changed since the last checkpoint,
+		/// first to the journal and then to the file, and wait for it all to reach the disk
+		/// @return Whether it all got there. If not, the file still holds the last checkpoint that did, once it is next opened
+		bool checkpoint() {
+			if( unfinished ) {
+				try {
+					this->recover(false);
+				}catch( std::runtime_error& e ) {
+					return false;
+				}
+				unfinished = false;
+			}
+			header->code = hash(code);
+			header->position = position;
+			header->active_cell = active_cell;
+			header->saved = 1;
+			// Runs of neighbouring pages are written as one record, up to a window long
+			std::vector<Record> records = { { 0, sizeof(Header) } };
+			for( size_t p : dirty ) {
+				uint64_t offset = header_size + p * page;
+				uint64_t length = this->pageLength(p);
+				if( records.size() > 1 && records.back().offset + records.back().length == offset && records.back().length < window ) {
+					records.back().length += length;
+				}else {
+					records.push_back({ offset, length });
+				}
+			}
+
+			int journal = open((path + ".journal").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if( journal < 0 ) {
+				return false;
+			}
+			Commit commit = {};
+			bool ok = write(journal, &commit, sizeof(Commit)) == (ssize_t)sizeof(Commit);
+			for( const Record& record : records ) {
+				const char* data = (const char*)header + record.offset;
+				ok = ok && write(journal, &record, sizeof(Record)) == (ssize_t)sizeof(Record);
+				for( uint64_t done = 0; ok && done < record.length; ) {
+					ssize_t n = write(journal, data + done, record.length - done);
+					ok = n > 0;
+					done += ok? n : 0;
+				}
+			}
+			memcpy(commit.magic, "QFJRNL1", 8);
+			commit.records = records.size();
+			// Only committed once the records are on the disk, so a journal cut short is never mistaken for a whole one
+			ok = ok && fsync(journal) == 0 && pwrite(journal, &commit, sizeof(Commit), 0) == (ssize_t)sizeof(Commit) && fsync(journal) == 0;
+			if( !ok ) {
+				close(journal);
+				return false;
+			}
+
+			// From here on, a crash leaves recover() to finish writing it to the file
+			for( size_t i = 0; ok && i < records.size(); i++ ) {
+				const char* data = (const char*)header + records[i].offset;
+				for( uint64_t done = 0; ok && done < records[i].length; ) {
+					ssize_t n = pwrite(fd, data + done, records[i].length - done, records[i].offset + done);
+					ok = n > 0;
+					done += ok? n : 0;
+				}
+			}
+			ok = ok && fsync(fd) == 0 && ftruncate(journal, 0) == 0;
+			close(journal);
+			if( !ok ) {
+				unfinished = true;
+				return false;
+			}
+			// The file has the pages now, so map them from it again to stop the private copies piling up in memory
+			for( size_t i = 1; i < records.size(); i++ ) {
+				this->reload(records[i].offset, records[i].length);
+			}
+			dirty.clear();
+			last_dirty = (size_t)-1;
+			return true;
+		}
+
+		virtual Status tryStep() {
+			char c = code[position];
+			Status s = PerformanceInterpreter::tryStep();
+			if( s == Status::Ok && (c == '+' || c == '-' || c == ',') ) {
+				this->touch(active_cell);
+			}
+			this->advise();
+			return s;
+		}
+
+		virtual void setValue( size_t i, char v ) {
+			PerformanceInterpreter::setValue(i, v);
+			this->touch(i);
+		}
+		virtual void setValue( char v ) {
+			PerformanceInterpreter::setValue(v);
+			this->touch(active_cell);
+		}
+		virtual Status setTape( const char* data, size_t n ) {
+			Status s = PerformanceInterpreter::setTape(data, n);
+			if( s == Status::Ok ) {
+				this->touch(0, n);
+			}
+			return s;
+		}
+	};
+#endif
+
+	/// Operations produced by the Compiler
+	/// Cells are addressed relative to the pointer, at the instruction's offset
+	enum class Op : unsigned char {
+		Add,    ///< Add arg to the cell
+		Move,   ///< Move the pointer by arg
+		Output, ///< Append the cell to the output
+		Input,  ///< Read one character of input into the cell
+		Open,   ///< Jump to target if the active cell is zero
+		Close,  ///< Jump to target if the active cell is not zero
+		EndIf,  ///< The end of a loop that runs at most once, so never jumps back, removed by linking
+		Jump,   ///< Jump to target unconditionally
+		Lazy,   ///< Stub for code from source onwards that has not been compiled yet
+		LazyLoop, ///< Stub for the loop between source and arg that has not been compiled yet
+		Halt,   ///< End of the program
+		Set,    ///< Set the cell to arg
+		MulAdd, ///< Add the cell at from, multiplied by arg, to the cell
+		Scan,   ///< Move the pointer by arg until the active cell is zero
+		Shift,  ///< Run [[-<+>]>], or [[->+<]<] when arg is -1, moving the cells up to the next zero one place along
+		Map,    ///< Add arg to the active cell and move the pointer by from, until the active cell is zero
+		Print,  ///< Append the Program's texts[arg] to the output
+		WriteBlock, ///< Append arg cells, from the cell onwards, to the output
+		ReadBlock,  ///< Read arg characters of input into the cell onwards and skip the arg Inputs after it, which run instead if there is less input
+		Blank,  ///< The whole tape is zero here, at the start of a program when the PassManager assumes it, removed once the passes have run
+		Intrinsic, ///< Do the work of the code after it natively, for Intrinsics idiom from with the cells in the Program's layouts[arg], and jump to target
+		Debug,  ///< Call the debug hook, for a '#' when there is one
+		Fence   ///< Keeps the passes from moving code across it, and is removed once they have run
+	};
+
+	/// A single compiled operation
+	struct Instruction {
+		Op op;
+		long arg = 0;
+		/// Position in the source code this instruction came from
+		size_t source = 0;
+		/// The cell operated on, relative to the pointer
+		long offset = 0;
+		/// The cell read by MulAdd, relative to the pointer, how far Map moves each time, or the idiom an Intrinsic does
+		long from = 0;
+		/// Jump destination, only used by Open, Close, Jump and Intrinsic
+		size_t target = 0;
+	};
+	// Passes copy instructions around all the time, so anything bigger goes in the Program instead
+	static_assert(std::is_trivially_copyable<Instruction>::value, "Instruction has to stay trivially copyable");
+
+	/// Compiled code, with the lists too long to keep in an Instruction, which refer to them by index
+	/// Passes only ever add to the lists, so the instructions of an older copy of a Program still fit a newer one
+	struct Program : std::vector<Instruction> {
+		/// Where each of an Intrinsic's cells is, relative to the pointer
+		std::vector<std::vector<long>> layouts;
+		/// What each Print writes
+		std::vector<std::string> texts;
+	};
+
+	/// An SSA value for straight-line cell arithmetic: a constant plus a sum of
+	/// multiples of the cells' values on entry to the region, all modulo 256.
+	/// Terms are keyed by cell offset; Validator also keys characters of input read inside the region
+	struct Value {
+		long constant = 0;
+		std::map<long, long> terms;
+
+		bool operator<( const Value& v ) const {
+			return constant != v.constant? constant < v.constant : terms < v.terms;
+		}
+		bool operator==( const Value& v ) const {
+			return constant == v.constant && terms == v.terms;
+		}
+	};
+
+	/// Numbers each distinct Value, so cells holding the same value share a number
+	class ValueTable {
+		std::vector<Value> values;
+		std::map<Value, size_t> numbers;
+	public:
+		size_t number( Value v ) {
+			v.constant &= 0xFF;
+			for( auto i = v.terms.begin(); i != v.terms.end(); ) {
+				i->second &= 0xFF;
+				if( i->second == 0 ) {
+					i = v.terms.erase(i);
+				}else {
+					i++;
+				}
+			}
+			auto found = numbers.find(v);
+			if( found != numbers.end() ) {
+				return found->second;
+			}
+			values.push_back(v);
+			return numbers[v] = values.size() - 1;
+		}
+		const Value& operator[]( size_t n ) const {
+			return values[n];
+		}
+		/// The value of a cell nothing has written to yet
+		size_t entry( long cell ) {
+			Value v;
+			v.terms[cell] = 1;
+			return this->number(v);
+		}
+		/// The value of a plus b times k
+		size_t add( size_t a, size_t b, long k ) {
+			Value v = values[a];
+			const Value& w = values[b];
+			v.constant += w.constant * k;
+			for( const auto& term : w.terms ) {
+				v.terms[term.first] += term.second * k;
+			}
+			return this->number(v);
+		}
+		size_t constant( long c ) {
+			Value v;
+			v.constant = c;
+			return this->number(v);
+		}
+	};
+
+	/// Native versions of well-known algorithms built from several loops, which the general passes
+	/// can't see through. The intrinsics pass finds them in lowered code and puts an Intrinsic in front,
+	/// which does the work and jumps past the code when its guard holds, and falls through into the
+	/// code when it doesn't, so unusual inputs still get the original behaviour.
+	/// Each idiom has one or two inputs, and expects the other cells it uses to start at zero
+	class Intrinsics {
+	public:
+		enum Kind {
+			DivMod,      ///< n d 0 0 0 0 becomes 0 d-n%d n%d n/d 0 0, for d of 2 or more
+			DivModKeep,  ///< n 0 d 0 0 0 0 becomes 0 n d-n%d n%d n/d 0 0, for d of 2 or more
+			Greater,     ///< x y 0 0 0 becomes 0 y-x 0 0 x>y, with the five cells in any order
+			PrintDecimal ///< Prints x in decimal, leaving x and the nine zeroed cells after it as they were
+		};
+		struct Idiom {
+			const char* name;
+			/// The canonical source, which starts with the pointer on the first input
+			const char* text;
+			/// How many cells it uses, numbered from the first input
+			long cells;
+			/// The cell holding the second input, or -1 if there is only one
+			long second;
+			/// Whether the cells can be laid out in any order, or only as they are in text.
+			/// Only possible when every loop in text leaves the pointer where it found it
+			bool relocatable;
+		};
+
+		static const std::vector<Idiom>& idioms() {
+			static const std::vector<Idiom> all = {
+				{ "divmod", "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]", 6, 1, false },
+				{ "divmod", "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]", 7, 2, false },
+				{ "greater", "[>>+<[->[-]>+<<]>[->>+<<]>[-<<+>>]<<-<-]", 5, 1, true },
+				{ "printdecimal", ">>++++++++++<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>[-]>>>++++++++++<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]"
+					">[-]>>[>++++++[-<++++++++>]<.<<+>+>[-]]<[<[->-<]++++++[->++++++++<]>.[-]]<<++++++[-<++++++++>]<.[-]<<[-<+>]<", 10, -1, false }
+			};
+			return all;
+		}
+
+		/// Put an Intrinsic in front of every match of an idiom in a chunk of lowered, unlinked code,
+		/// and a Fence after it. Until the code is linked, the target of the Intrinsic is the source
+		/// position of the last instruction it stands in for
+		static void apply( Program& program ) {
+			Program out;
+			out.reserve(program.size());
+			std::vector<long> cells;
+			for( size_t i = 0; i < program.size(); ) {
+				bool matched = false;
+				for( size_t kind = 0; kind < idioms().size() && !matched; kind++ ) {
+					if( !match(kind, program, i, cells) ) {
+						continue;
+					}
+					size_t length = patterns()[kind].size();
+					Instruction ins = { Op::Intrinsic, (long)program.layouts.size(), program[i].source, 0, (long)kind };
+					program.layouts.push_back(cells);
+					ins.target = program[i + length - 1].source;
+					out.push_back(ins);
+					out.insert(out.end(), program.begin() + i, program.begin() + i + length);
+					out.push_back({ Op::Fence, 0, ins.target });
+					i += length;
+					matched = true;
+				}
+				if( !matched ) {
+					out.push_back(program[i++]);
+				}
+			}
+			program.swap(out);
+		}
+
+		/// Do the work of an idiom natively, if its guard holds
+		/// @param tape The active cell at the start of the idiom
+		/// @param cells Where each of the idiom's cells is, relative to the active cell
+		/// @param output Where anything the idiom prints goes
+		/// @return false, without touching anything, if the original code has to run instead
+		static bool run( size_t kind, unsigned char* tape, const std::vector<long>& cells, std::string& output ) {
+			const Idiom& idiom = idioms()[kind];
+			unsigned char a = tape[0];
+			if( a == 0 && kind != PrintDecimal ) { // The loop would not run at all
+				return false;
+			}
+			for( long c = 1; c < idiom.cells; c++ ) {
+				if( c != idiom.second && tape[cells[c]] != 0 )
+					return false;
+			}
+			unsigned char b = idiom.second < 0? 0 : tape[cells[idiom.second]];
+			switch( kind ) {
+				case DivMod:
+				case DivModKeep:
+					if( b < 2 ) { // d = 1 runs off the end of the algorithm's cells, d = 0 never ends
+						return false;
+					}
+					if( kind == DivModKeep )
+						tape[cells[1]] = a;
+					tape[cells[idiom.second]] = b - a % b;
+					tape[cells[idiom.second + 1]] = a % b;
+					tape[cells[idiom.second + 2]] = a / b;
+					tape[0] = 0;
+					break;
+				case Greater:
+					tape[cells[1]] = b - a;
+					tape[cells[4]] = a > b;
+					tape[0] = 0;
+					break;
+				case PrintDecimal: {
+					char digits[3];
+					int n = 0;
+					do {
+						digits[n++] = '0' + a % 10;
+						a /= 10;
+					}while( a != 0 );
+					while( n > 0 )
+						output += digits[--n];
+					break;
+				}
+			}
+			return true;
+		}
+
+		/// Whether run() agrees with the idiom's source for every input, or pair of inputs, it accepts
+		/// Worked out the first time it is asked for, by running the source on all of them
+		static bool proven( size_t kind ) {
+			switch( kind ) {
+				case DivMod: { static const bool p = verify(DivMod); return p; }
+				case DivModKeep: { static const bool p = verify(DivModKeep); return p; }
+				case Greater: { static const bool p = verify(Greater); return p; }
+				case PrintDecimal: { static const bool p = verify(PrintDecimal); return p; }
+			}
+			return false;
+		}
+
+	private:
+		/// The idioms' source, folded the same way the Compiler folds code
+		static const std::vector<Program>& patterns() {
+			static const std::vector<Program> all = lowerAll();
+			return all;
+		}
+		static std::vector<Program> lowerAll() {
+			std::vector<Program> all;
+			for( const Idiom& idiom : idioms() ) {
+				Program p;
+				for( const char* c = idiom.text; *c; c++ ) {
+					Op op = *c == '+' || *c == '-'? Op::Add : *c == '>' || *c == '<'? Op::Move
+						: *c == '['? Op::Open : *c == ']'? Op::Close : Op::Output;
+					long arg = *c == '+' || *c == '>'? 1 : *c == '-' || *c == '<'? -1 : 0;
+					if( !p.empty() && p.back().op == op && (op == Op::Add || op == Op::Move) ) {
+						p.back().arg += arg;
+					}else {
+						p.push_back({ op, arg, (size_t)(c - idiom.text) });
+					}
+				}
+				all.push_back(p);
+			}
+			return all;
+		}
+
+		/// Match the code at `at` against an idiom, working out where its cells are
+		static bool match( size_t kind, const Program& program, size_t at, std::vector<long>& cells ) {
+			const Idiom& idiom = idioms()[kind];
+			const Program& pattern = patterns()[kind];
+			if( program.size() - at < pattern.size() || program[at].op != pattern[0].op ) {
+				return false;
+			}
+			cells.assign(idiom.cells, 0);
+			std::vector<bool> bound(idiom.cells, false);
+			bound[0] = true;
+			long p = 0, q = 0;
+			for( size_t i = 0; i < pattern.size(); i++ ) {
+				const Instruction& want = pattern[i];
+				const Instruction& ins = program[at + i];
+				if( ins.op != want.op || ins.offset != 0 ) {
+					return false;
+				}
+				if( want.op == Op::Add && ((ins.arg - want.arg) & 0xFF) != 0 ) {
+					return false;
+				}
+				if( want.op != Op::Move ) {
+					continue;
+				}
+				if( !idiom.relocatable ) {
+					if( ins.arg != want.arg )
+						return false;
+					continue;
+				}
+				p += want.arg;
+				q += ins.arg;
+				if( bound[p] ) {
+					if( cells[p] != q )
+						return false;
+				}else {
+					for( long c = 0; c < idiom.cells; c++ ) {
+						if( bound[c] && cells[c] == q ) // Two of the idiom's cells in the same place
+							return false;
+					}
+					cells[p] = q;
+					bound[p] = true;
+				}
+			}
+			for( long c = 0; c < idiom.cells; c++ ) {
+				if( !idiom.relocatable ) {
+					cells[c] = c;
+				}else if( !bound[c] ) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/// The cells an idiom uses, while verifying it
+		typedef std::array<unsigned char, 10> State;
+
+		static bool verify( size_t kind ) {
+			const Idiom& idiom = idioms()[kind];
+			const Program& program = patterns()[kind];
+			std::vector<size_t> partner(program.size());
+			std::stack<size_t> open;
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op == Op::Open ) {
+					open.push(i);
+				}else if( program[i].op == Op::Close ) {
+					partner[i] = open.top();
+					partner[open.top()] = i;
+					open.pop();
+				}
+			}
+			std::vector<long> cells;
+			for( long c = 0; c < idiom.cells; c++ )
+				cells.push_back(c);
+			// For a single loop that prints nothing, where the loop ends up from states at the top of it
+			// whose next pass was slow, because comparison is quadratic and many inputs pass through the same states
+			bool memo = program[0].op == Op::Open && partner[0] == program.size() - 1 && strchr(idiom.text, '.') == nullptr;
+			std::map<State, State> known;
+			bool same = true;
+			for( int a = 0; a < 256 && same; a++ ) {
+				for( int b = 0; b < (idiom.second < 0? 1 : 256) && same; b++ ) {
+					State native = {}, raw = {};
+					std::string expected, printed;
+					native[0] = raw[0] = a;
+					if( idiom.second >= 0 )
+						native[idiom.second] = raw[idiom.second] = b;
+					if( !run(kind, native.data(), cells, expected) ) {
+						continue;
+					}
+					if( !memo ) {
+						size_t steps = 0;
+						same = execute(program, partner, 0, program.size(), idiom.cells, raw, printed, steps);
+					}
+					std::vector<State> slow;
+					for( size_t passes = 0; memo && raw[0] != 0 && same; passes++ ) {
+						auto found = known.find(raw);
+						if( found != known.end() ) {
+							raw = found->second;
+							break;
+						}
+						State before = raw;
+						size_t steps = 0;
+						same = passes < 0x10000 && execute(program, partner, 1, program.size() - 1, idiom.cells, raw, printed, steps);
+						if( steps > 16 )
+							slow.push_back(before);
+					}
+					for( const State& s : slow )
+						known[s] = raw;
+					same = same && raw == native && printed == expected;
+				}
+			}
+			return same;
+		}
+
+		/// Run part of an idiom's source on its own cells
+		/// @param steps Counts the times a loop goes round
+		/// @return false if it went outside them, did not finish, or did not come back to the first cell
+		static bool execute( const Program& program, const std::vector<size_t>& partner, size_t begin, size_t end,
+				long cells, State& tape, std::string& output, size_t& steps ) {
+			long p = 0;
+			for( size_t i = begin; i < end; i++ ) {
+				const Instruction& ins = program[i];
+				switch( ins.op ) {
+					case Op::Add:
+						tape[p] += (unsigned char)ins.arg;
+						break;
+					case Op::Move:
+						p += ins.arg;
+						if( p < 0 || p >= cells )
+							return false;
+						break;
+					case Op::Output:
+						output += (char)tape[p];
+						break;
+					case Op::Open:
+						if( tape[p] == 0 )
+							i = partner[i];
+						break;
+					default:
+						if( tape[p] != 0 ) {
+							i = partner[i];
+							if( ++steps > 1000000 )
+								return false;
+						}
+						break;
+				}
+			}
+			return p == 0;
+		}
+	};
+
+	/// Translation validation, which checks that optimised code has exactly the same effect on
+	/// the tape, pointer and output as the code it was optimised from, modulo 256.
+	/// Code is split into regions at the loops, stubs and jumps the optimiser keeps, and the effect
+	/// of each region is worked out symbolically from the values of the cells on entry to it.
+	/// Loops removed by the optimiser are modelled by running their counter through all 256 values
+	/// rather than with the optimiser's own arithmetic, so the two are checked independently
+	class Validator {
+	public:
+		enum Mode {
+			Off,
+			Fallback, ///< Replace regions that cannot be proven with the unoptimised code
+			Strict    ///< Throw std::runtime_error for regions that cannot be proven
+		};
+
+	private:
+		/// Key of the nth character of input read inside a region, in Value terms
+		static long inputKey( size_t n ) {
+			return std::numeric_limits<long>::min() + (long)n;
+		}
+
+		enum Event { Output, Cell, Pointer, Scan, Shift, Map, Debug };
+
+		/// The symbolic effect of one side of a region
+		struct State {
+			ValueTable& table;
+			std::map<long, size_t> cells;
+			long pointer = 0;
+			size_t inputs = 0;
+			/// Whether every cell started out zero, after a Blank
+			bool blank = false;
+			/// Everything observable, in order
+			std::vector<std::array<long, 3>> trace;
+
+			State( ValueTable& t ) : table(t) {}
+
+			size_t cell( long o ) {
+				auto found = cells.find(o);
+				return found != cells.end()? found->second : this->entry(o);
+			}
+			size_t entry( long o ) {
+				return blank? table.constant(0) : table.entry(o);
+			}
+			/// Record the cells and pointer, then start again from wherever the pointer is now
+			void flush() {
+				for( const auto& c : cells ) {
+					if( c.second != this->entry(c.first) )
+						trace.push_back({ Cell, c.first, (long)c.second });
+				}
+				trace.push_back({ Pointer, pointer, (long)inputs });
+				cells.clear();
+				pointer = 0;
+				blank = false;
+			}
+		};
+
+		Mode mode = Off;
+		size_t proven = 0;
+		size_t failed = 0;
+
+	public:
+		void setMode( Mode m ) {
+			mode = m;
+		}
+		Mode getMode() {
+			return mode;
+		}
+
+		/// Check every region of an optimised chunk against the chunk it was optimised from
+		/// Both must be unlinked. In Fallback mode, unproven regions of optimised are replaced
+		/// @throws std::runtime_error in Strict mode, if a region cannot be proven
+		void check( const Program& original, Program& optimised ) {
+			Program out;
+			size_t i = 0, j = 0;
+			while( true ) {
+				size_t k = i;
+				while( k < optimised.size() && !isAnchor(optimised[k].op) )
+					k++;
+				size_t l = j;
+				if( k < optimised.size() ) {
+					while( l < original.size() && (!sameAnchor(original[l].op, optimised[k].op) || original[l].source != optimised[k].source) )
+						l++;
+				}else {
+					l = original.size();
+				}
+				if( l == original.size() && k < optimised.size() ) { // The optimiser changed the structure itself
+					this->reject(optimised.empty()? 0 : optimised[0].source);
+					optimised = original;
+					return;
+				}
+				// An EndIf only stands in for a Close if the counter is always zero by then
+				bool cleared = k < optimised.size() && optimised[k].op == Op::EndIf;
+				bool same = this->equivalent(original, j, l, optimised, i, k, cleared);
+				if( same ) {
+					proven++;
+					out.insert(out.end(), optimised.begin() + i, optimised.begin() + k);
+				}else {
+					this->reject(j < l? original[j].source : k < optimised.size()? optimised[k].source : 0);
+					out.insert(out.end(), original.begin() + j, original.begin() + l);
+				}
+				if( k == optimised.size() ) {
+					break;
+				}
+				out.push_back(same? optimised[k] : original[l]);
+				i = k + 1;
+				j = l + 1;
+			}
+			optimised.swap(out);
+		}
+
+		std::string report() {
+			return "Validated " + std::to_string(proven) + " regions, " + std::to_string(failed) + " could not be proven\n";
+		}
+
+	private:
+		/// Instructions the optimiser must keep where they are
+		static bool isAnchor( Op op ) {
+			return op == Op::Open || op == Op::Close || op == Op::EndIf || op == Op::Jump || op == Op::Lazy || op == Op::LazyLoop || op == Op::Halt;
+		}
+		static bool sameAnchor( Op original, Op optimised ) {
+			return original == optimised || (original == Op::Close && optimised == Op::EndIf);
+		}
+
+		void reject( size_t source ) {
+			failed++;
+			if( mode == Strict ) {
+				throw std::runtime_error("Could not validate the optimised code at " + std::to_string(source));
+			}
+		}
+
+		/// @param cleared Whether the active cell has to end up zero on both sides
+		bool equivalent( const Program& a, size_t a_begin, size_t a_end, const Program& b, size_t b_begin, size_t b_end, bool cleared ) {
+			ValueTable table;
+			State x(table), y(table);
+			if( !this->execute(a, a_begin, a_end, x) || !this->execute(b, b_begin, b_end, y) ) {
+				return false;
+			}
+			if( cleared && (x.cell(x.pointer) != table.constant(0) || y.cell(y.pointer) != table.constant(0)) ) {
+				return false;
+			}
+			x.flush();
+			y.flush();
+			return x.trace == y.trace;
+		}
+
+		/// Work out the effect of a region symbolically
+		/// @return false if it contains something that cannot be modelled
+		bool execute( const Program& program, size_t begin, size_t end, State& state ) {
+			ValueTable& table = state.table;
+			for( size_t i = begin; i < end; i++ ) {
+				const Instruction& ins = program[i];
+				long o = state.pointer + ins.offset;
+				switch( ins.op ) {
+					case Op::Add:
+						state.cells[o] = table.add(state.cell(o), table.constant(1), ins.arg);
+						break;
+					case Op::Set:
+						state.cells[o] = table.constant(ins.arg);
+						break;
+					case Op::MulAdd:
+						state.cells[o] = table.add(state.cell(o), state.cell(state.pointer + ins.from), ins.arg);
+						break;
+					case Op::Move:
+						state.pointer += ins.arg;
+						break;
+					case Op::Output:
+						state.trace.push_back({ Output, (long)state.cell(o), 0 });
+						break;
+					case Op::Print:
+						for( char c : program.texts[ins.arg] )
+							state.trace.push_back({ Output, (long)table.constant((unsigned char)c), 0 });
+						break;
+					case Op::WriteBlock:
+						for( long c = 0; c < ins.arg; c++ )
+							state.trace.push_back({ Output, (long)state.cell(o + c), 0 });
+						break;
+					case Op::ReadBlock: // The Inputs it stands in for are still there
+						break;
+					case Op::Debug: // The hook sees the whole tape
+						state.flush();
+						state.trace.push_back({ Debug, 0, 0 });
+						break;
+					case Op::Blank:
+						state.blank = true;
+						break;
+					case Op::Input: {
+						Value v;
+						v.terms[inputKey(state.inputs++)] = 1;
+						state.cells[o] = table.number(v);
+						break;
+					}
+					case Op::Scan:
+						state.flush();
+						state.trace.push_back({ Scan, ins.arg, 0 });
+						break;
+					case Op::Intrinsic: // The code it stands in for is still there, so it is a no-op once proven
+						if( !Intrinsics::proven(ins.from) )
+							return false;
+						break;
+					case Op::Fence:
+						break;
+					case Op::Shift:
+						state.flush();
+						state.trace.push_back({ Shift, ins.arg, 0 });
+						break;
+					case Op::Map:
+						state.flush();
+						state.trace.push_back({ Map, ins.from, ins.arg & 0xFF });
+						break;
+					case Op::Open: {
+						size_t close = i + 1;
+						while( close < end && (program[close].op == Op::Add || program[close].op == Op::Move) )
+							close++;
+						long step;
+						if( close < end && program[close].op == Op::Close && this->loop(program, i + 1, close, state) ) {
+							i = close;
+						}else if( (close = shift(program, i, end, step)) != 0 ) {
+							state.flush();
+							state.trace.push_back({ Shift, step, 0 });
+							i = close;
+						}else {
+							return false;
+						}
+						break;
+					}
+					default:
+						return false;
+				}
+			}
+			return true;
+		}
+
+		/// Whether the loop opened at begin is [[-<+>]>] or [[->+<]<], which shift cells
+		/// @param step Receives how far the pointer moves each time round
+		/// @return The index of the loop's Close, or 0 if it isn't one of those
+		static size_t shift( const Program& program, size_t begin, size_t end, long& step ) {
+			size_t close = begin + 2;
+			while( close < end && (program[close].op == Op::Add || program[close].op == Op::Move) )
+				close++;
+			if( close + 2 >= end || program[begin + 1].op != Op::Open || program[close].op != Op::Close
+					|| program[close + 1].op != Op::Move || program[close + 2].op != Op::Close ) {
+				return 0;
+			}
+			step = program[close + 1].arg;
+			std::map<long, long> deltas;
+			long move = 0;
+			for( size_t i = begin + 2; i < close; i++ ) {
+				if( program[i].op == Op::Move ) {
+					move += program[i].arg;
+				}else {
+					deltas[move + program[i].offset] += program[i].arg;
+				}
+			}
+			if( move != 0 || (step != 1 && step != -1) || deltas.size() != 2 || (deltas[0] & 0xFF) != 0xFF || (deltas[-step] & 0xFF) != 1 ) {
+				return 0;
+			}
+			return close + 2;
+		}
+
+		/// The effect of a loop made of Add and Move
+		bool loop( const Program& program, size_t begin, size_t end, State& state ) {
+			std::map<long, long> deltas;
+			long move = 0;
+			for( size_t i = begin; i < end; i++ ) {
+				if( program[i].op == Op::Move ) {
+					move += program[i].arg;
+				}else {
+					deltas[move + program[i].offset] += program[i].arg;
+				}
+			}
+			for( auto i = deltas.begin(); i != deltas.end(); ) {
+				if( (i->second & 0xFF) == 0 ) {
+					i = deltas.erase(i);
+				}else {
+					i++;
+				}
+			}
+			if( move != 0 ) {
+				if( deltas.empty() ) {
+					state.flush();
+					state.trace.push_back({ Scan, move, 0 });
+					return true;
+				}
+				if( deltas.size() != 1 || deltas.count(0) == 0 )
+					return false;
+				state.flush();
+				state.trace.push_back({ Map, move, deltas[0] & 0xFF });
+				return true;
+			}
+			int m = deltas.count(0)? multiplier(deltas[0] & 0xFF) : -1;
+			if( m < 0 ) {
+				return false;
+			}
+			ValueTable& table = state.table;
+			size_t counter = state.cell(state.pointer);
+			for( const auto& d : deltas ) {
+				long o = state.pointer + d.first;
+				if( d.first != 0 )
+					state.cells[o] = table.add(state.cell(o), counter, d.second * m);
+			}
+			state.cells[state.pointer] = table.constant(0);
+			return true;
+		}
+
+		/// How many times a loop whose counter steps by d runs, per unit of the counter's starting value
+		/// @return -1 if that is not the same for every starting value, or the loop might never end
+		static int multiplier( long d ) {
+			static const std::vector<int> known = multipliers();
+			return known[d];
+		}
+		static std::vector<int> multipliers() {
+			std::vector<int> known(256, -1);
+			for( int d = 1; d < 256; d++ ) {
+				int runs[256] = { 0 };
+				bool linear = true;
+				for( int v = 1; v < 256 && linear; v++ ) {
+					int c = v;
+					while( c != 0 && runs[v] <= 256 ) {
+						c = (c + d) & 0xFF;
+						runs[v]++;
+					}
+					linear = c == 0 && (runs[v] & 0xFF) == ((v * runs[1]) & 0xFF);
+				}
+				if( linear ) {
+					known[d] = runs[1] & 0xFF;
+				}
+			}
+			return known;
+		}
+	};
+
+	/// Rewrite rules for idioms the general passes don't know about, usually loaded from a file.
+	/// Each line holds one rule, and // starts a comment:
+	///
+	///     name: pattern => replacement
+	///
+	/// The pattern is Brainfuck, matched against the folded code, so "+++" matches an Add of 3.
+	/// A single + - > or < followed by {x} matches a whole run of that command and captures its
+	/// length as x; using x again in the same pattern only matches a run of the same length.
+	/// The replacement is a list of instructions separated by ';', with cells relative to the
+	/// pointer at the start of the match:
+	///
+	///     add CELL N | set CELL N | muladd CELL FROM N | move N | out CELL | in CELL | scan N
+	///
+	/// Every operand is a sum of integers, captures and products of the two, like "-a", "b+1" or "2*n".
+	/// For example, a loop doubling the active cell into the one a cells to the right:
+	///
+	///     double: [->{a}++<{a}] => muladd a 0 2; set 0 0
+	class RuleSet {
+		struct Expression {
+			long constant = 0;
+			/// Capture index and multiplier
+			std::vector<std::pair<size_t, long>> terms;
+
+			long evaluate( const std::vector<long>& captures ) const {
+				long v = constant;
+				for( const auto& t : terms )
+					v += captures[t.first] * t.second;
+				return v;
+			}
+		};
+		struct Element {
+			Op op;
+			/// The literal argument, or the sign of a captured run
+			long arg;
+			/// Capture index, or -1 for a literal
+			long capture;
+		};
+		struct Emit {
+			Op op;
+			Expression arg, offset, from;
+		};
+		struct Rule {
+			std::string name;
+			std::vector<Element> pattern;
+			std::vector<Emit> replacement;
+			size_t captures = 0;
+			size_t matches = 0;
+		};
+
+		std::vector<Rule> rules;
+
+	public:
+		/// Load every rule in a stream
+		/// @throws std::invalid_argument for a malformed rule, giving its line
+		void load( std::istream& in ) {
+			std::string line;
+			for( size_t n = 1; std::getline(in, line); n++ ) {
+				size_t comment = line.find("//");
+				if( comment != std::string::npos )
+					line.erase(comment);
+				if( line.find_first_not_of(" \t\r") == std::string::npos )
+					continue;
+				try {
+					this->add(line);
+				}catch( std::invalid_argument& e ) {
+					throw std::invalid_argument("Rule on line " + std::to_string(n) + ": " + e.what());
+				}
+			}
+		}
+
+		/// Add a single rule, in the same format as a line of a rule file
+		/// @throws std::invalid_argument if it is malformed
+		void add( const std::string& text ) {
+			size_t colon = text.find(':');
+			size_t arrow = text.find("=>");
+			if( colon == std::string::npos || arrow == std::string::npos || arrow < colon ) {
+				throw std::invalid_argument("expected 'name: pattern => replacement'");
+			}
+			Rule rule;
+			rule.name = trim(text.substr(0, colon));
+			std::vector<std::string> names;
+			this->parsePattern(text.substr(colon + 1, arrow - colon - 1), rule, names);
+			this->parseReplacement(text.substr(arrow + 2), rule, names);
+			rules.push_back(rule);
+		}
+
+		size_t size() {
+			return rules.size();
+		}
+
+		/// Replace every match of every rule in a chunk of lowered, unlinked code
+		/// Earlier rules win when more than one matches at the same place
+		void apply( Program& program ) {
+			if( rules.empty() ) {
+				return;
+			}
+			Program out;
+			out.reserve(program.size());
+			std::vector<long> captures;
+			for( size_t i = 0; i < program.size(); ) {
+				bool matched = false;
+				for( Rule& rule : rules ) {
+					if( !this->match(rule, program, i, captures) ) {
+						continue;
+					}
+					for( const Emit& e : rule.replacement ) {
+						Instruction ins = { e.op, e.arg.evaluate(captures), program[i].source };
+						ins.offset = e.offset.evaluate(captures);
+						ins.from = e.from.evaluate(captures);
+						out.push_back(ins);
+					}
+					rule.matches++;
+					i += rule.pattern.size();
+					matched = true;
+					break;
+				}
+				if( !matched ) {
+					out.push_back(program[i++]);
+				}
+			}
+			program.swap(out);
+		}
+
+		/// How often each rule matched
+		std::string report() {
+			std::stringstream out;
+			for( const Rule& rule : rules ) {
+				out << "Rule " << rule.name << ": " << rule.matches << " matches\n";
+			}
+			return out.str();
+		}
+
+	private:
+		static std::string trim( const std::string& s ) {
+			size_t begin = s.find_first_not_of(" \t\r");
+			size_t end = s.find_last_not_of(" \t\r");
+			return begin == std::string::npos? "" : s.substr(begin, end - begin + 1);
+		}
+
+		static size_t captureIndex( const std::string& name, std::vector<std::string>& names ) {
+			for( size_t i = 0; i < names.size(); i++ ) {
+				if( names[i] == name )
+					return i;
+			}
+			names.push_back(name);
+			return names.size() - 1;
+		}
+
+		void parsePattern( const std::string& text, Rule& rule, std::vector<std::string>& names ) {
+			for( size_t i = 0; i < text.length(); ) {
+				char c = text[i];
+				if( c == ' ' || c == '\t' ) {
+					i++;
+					continue;
+				}
+				Op op;
+				switch( c ) {
+					case '+': case '-': op = Op::Add; break;
+					case '>': case '<': op = Op::Move; break;
+					case '[': op = Op::Open; break;
+					case ']': op = Op::Close; break;
+					case '.': op = Op::Output; break;
+					case ',': op = Op::Input; break;
+					default:
+						throw std::invalid_argument(std::string("unexpected '") + c + "' in pattern");
+				}
+				long sign = c == '+' || c == '>'? 1 : -1;
+				if( (op == Op::Add || op == Op::Move) && i + 1 < text.length() && text[i + 1] == '{' ) {
+					size_t close = text.find('}', i);
+					if( close == std::string::npos ) {
+						throw std::invalid_argument("unclosed '{' in pattern");
+					}
+					rule.pattern.push_back({ op, sign, (long)captureIndex(trim(text.substr(i + 2, close - i - 2)), names) });
+					i = close + 1;
+					continue;
+				}
+				if( op != Op::Add && op != Op::Move ) {
+					rule.pattern.push_back({ op, 0, -1 });
+					i++;
+					continue;
+				}
+				// A literal run, folded the same way the Compiler folds it
+				long arg = 0;
+				for( ; i < text.length() && (text[i] == c || text[i] == (op == Op::Add? '+' + '-' - c : '<' + '>' - c)); i++ ) {
+					if( i + 1 < text.length() && text[i + 1] == '{' )
+						throw std::invalid_argument("a capture has to follow a single command");
+					arg += text[i] == '+' || text[i] == '>'? 1 : -1;
+				}
+				if( !rule.pattern.empty() && rule.pattern.back().op == op ) {
+					throw std::invalid_argument("runs of the same command must be a single capture or literal");
+				}
+				if( arg != 0 )
+					rule.pattern.push_back({ op, arg, -1 });
+			}
+			if( rule.pattern.empty() ) {
+				throw std::invalid_argument("empty pattern");
+			}
+			rule.captures = names.size();
+		}
+
+		void parseReplacement( const std::string& text, Rule& rule, std::vector<std::string>& names ) {
+			std::stringstream list(text);
+			std::string item;
+			while( std::getline(list, item, ';') ) {
+				std::stringstream words(item);
+				std::string name;
+				if( !(words >> name) )
+					continue;
+				std::vector<Expression> operands;
+				std::string word;
+				while( words >> word )
+					operands.push_back(this->parseExpression(word, names));
+				struct { const char* name; Op op; size_t operands; } forms[] = {
+					{ "add", Op::Add, 2 }, { "set", Op::Set, 2 }, { "muladd", Op::MulAdd, 3 },
+					{ "move", Op::Move, 1 }, { "out", Op::Output, 1 }, { "in", Op::Input, 1 }, { "scan", Op::Scan, 1 }
+				};
+				bool known = false;
+				for( const auto& form : forms ) {
+					if( name != form.name )
+						continue;
+					if( operands.size() != form.operands ) {
+						throw std::invalid_argument(name + " takes " + std::to_string(form.operands) + " operands");
+					}
+					Emit e;
+					e.op = form.op;
+					if( form.op == Op::Move || form.op == Op::Scan ) {
+						e.arg = operands[0];
+					}else if( form.op == Op::Output || form.op == Op::Input ) {
+						e.offset = operands[0];
+					}else {
+						e.offset = operands[0];
+						e.arg = operands.back();
+						if( form.op == Op::MulAdd )
+							e.from = operands[1];
+					}
+					rule.replacement.push_back(e);
+					known = true;
+				}
+				if( !known ) {
+					throw std::invalid_argument("unknown instruction '" + name + "'");
+				}
+			}
+			if( names.size() != rule.captures ) {
+				throw std::invalid_argument("'" + names.back() + "' is not captured by the pattern");
+			}
+		}
+
+		Expression parseExpression( const std::string& text, std::vector<std::string>& names ) {
+			Expression e;
+			size_t i = 0;
+			while( i < text.length() ) {
+				long sign = 1;
+				if( text[i] == '+' || text[i] == '-' ) {
+					sign = text[i] == '-'? -1 : 1;
+					i++;
+				}
+				size_t end = text.find_first_of("+-", i);
+				std::string term = text.substr(i, end == std::string::npos? std::string::npos : end - i);
+				i = end == std::string::npos? text.length() : end;
+				size_t star = term.find('*');
+				long factor = sign;
+				if( star != std::string::npos ) {
+					factor *= this->parseNumber(term.substr(0, star));
+					term = term.substr(star + 1);
+				}
+				if( term.empty() ) {
+					throw std::invalid_argument("malformed operand '" + text + "'");
+				}
+				if( isdigit(term[0]) ) {
+					e.constant += factor * this->parseNumber(term);
+				}else {
+					e.terms.push_back({ captureIndex(term, names), factor });
+				}
+			}
+			return e;
+		}
+
+		long parseNumber( const std::string& text ) {
+			size_t used = 0;
+			long n = 0;
+			try {
+				n = std::stol(text, &used);
+			}catch( std::logic_error& ) {
+				used = std::string::npos;
+			}
+			if( used != text.length() ) {
+				throw std::invalid_argument("'" + text + "' is not a number");
+			}
+			return n;
+		}
+
+		bool match( const Rule& rule, const Program& program, size_t at, std::vector<long>& captures ) {
+			if( program.size() - at < rule.pattern.size() ) {
+				return false;
+			}
+			captures.assign(rule.captures, 0);
+			std::vector<bool> bound(rule.captures, false);
+			for( size_t i = 0; i < rule.pattern.size(); i++ ) {
+				const Element& e = rule.pattern[i];
+				const Instruction& ins = program[at + i];
+				if( ins.op != e.op || ins.offset != 0 ) {
+					return false;
+				}
+				if( e.op != Op::Add && e.op != Op::Move ) {
+					continue;
+				}
+				if( e.capture < 0 ) {
+					if( e.op == Op::Add? ((ins.arg - e.arg) & 0xFF) != 0 : ins.arg != e.arg )
+						return false;
+					continue;
+				}
+				long length = ins.arg * e.arg;
+				if( length <= 0 || (bound[e.capture] && captures[e.capture] != length) ) {
+					return false;
+				}
+				captures[e.capture] = length;
+				bound[e.capture] = true;
+			}
+			return true;
+		}
+	};
+
+	/// Runs optimisation passes over freshly lowered code
+	/// Passes are enabled by optimisation level, -O0 to -O3, and can also be switched on or off individually.
+	/// -O0 keeps one instruction per command, so it behaves exactly like step() on the other interpreters
+	class PassManager {
+	public:
+		/// A pass rewrites a chunk of lowered, unlinked code
+		typedef std::function<void( Program& )> Transform;
+		struct Pass {
+			const char* name;
+			/// The lowest level that enables the pass
+			int level;
+			/// nullptr for fold, which is done while lowering
+			Transform run;
+			/// -1 to follow the level, otherwise forced off or on
+			int forced = -1;
+			// Totals for report()
+			double seconds = 0;
+			size_t before = 0;
+			size_t after = 0;
+		};
+
+		static const int max_level = 3;
+
+	private:
+		std::vector<Pass> passes;
+		int level = 2;
+		bool timing = false;
+		bool zero_tape = false;
+		Validator validator;
+		/// Shared with the rules pass, so copies of the manager share their rules
+		std::shared_ptr<RuleSet> rules = std::make_shared<RuleSet>();
+
+	public:
+		PassManager() {
+			std::shared_ptr<RuleSet> r = rules;
+			passes = {
+				{ "fold", 1, nullptr },
+				{ "rules", 1, [r]( Program& p ) { r->apply(p); } },
+				{ "intrinsics", 2, &Intrinsics::apply },
+				{ "clear", 1, &clear },
+				{ "scan", 2, &scan },
+				{ "map", 2, &map },
+				{ "multiply", 2, &multiply },
+				{ "shift", 2, &shift },
+				{ "closedform", 3, &closedForm },
+				{ "offsets", 2, &offsets },
+				{ "constants", 2, &constants },
+				{ "gvn", 3, &gvn },
+				{ "blocks", 2, &blocks },
+				{ "branches", 2, &branches }
+			};
+		}
+
+		void setLevel( int l ) {
+			if( l < 0 || l > max_level ) {
+				throw std::invalid_argument("Optimisation level must be 0 to " + std::to_string(max_level));
+			}
+			level = l;
+		}
+		int getLevel() {
+			return level;
+		}
+
+		/// Force a pass on or off regardless of the level
+		/// @throws std::invalid_argument if there is no such pass
+		void enable( const std::string& name, bool on ) {
+			this->find(name).forced = on;
+		}
+		bool enabled( const std::string& name ) {
+			return this->isEnabled(this->find(name));
+		}
+
+		/// Collect the time spent in each pass, for report()
+		void setTiming( bool t ) {
+			timing = t;
+		}
+		bool getTiming() {
+			return timing;
+		}
+
+		/// The user-defined rewrite rules, which run before the built-in passes
+		RuleSet& getRules() {
+			return *rules;
+		}
+
+		/// Let the passes assume the tape is all zero at the start of the program, as it is after reset()
+		/// Only safe if nothing writes to the tape between resetting and running
+		void setZeroTape( bool z ) {
+			zero_tape = z;
+		}
+		bool getZeroTape() {
+			return zero_tape;
+		}
+
+		/// Check the output of the passes with a Validator
+		void setValidation( Validator::Mode mode ) {
+			validator.setMode(mode);
+		}
+
+		/// Apply a command line style option
+		/// Understands -O0 to -O3, -f<pass>, -fno-<pass>, --time-passes, --validate, --validate=strict,
+		/// --rules=<file> and --zero-tape
+		/// @throws std::invalid_argument for an unknown pass or a bad rule file
+		/// @return Whether the option was one of those
+		bool configure( const std::string& option ) {
+			if( option.length() == 3 && option.compare(0, 2, "-O") == 0 && isdigit(option[2]) ) {
+				this->setLevel(option[2] - '0');
+			}else if( option == "--time-passes" ) {
+				timing = true;
+			}else if( option == "--validate" ) {
+				validator.setMode(Validator::Fallback);
+			}else if( option == "--validate=strict" ) {
+				validator.setMode(Validator::Strict);
+			}else if( option == "--zero-tape" ) {
+				zero_tape = true;
+			}else if( option.compare(0, 8, "--rules=") == 0 ) {
+				std::ifstream file(option.substr(8));
+				if( !file ) {
+					throw std::invalid_argument("Rule file " + option.substr(8) + " not found");
+				}
+				rules->load(file);
+			}else if( option.compare(0, 5, "-fno-") == 0 ) {
+				this->enable(option.substr(5), false);
+			}else if( option.compare(0, 2, "-f") == 0 && option.length() > 2 ) {
+				this->enable(option.substr(2), true);
+			}else {
+				return false;
+			}
+			return true;
+		}
+
+		/// Run every enabled pass over the chunk, then validate the result if that is switched on
+		void run( Program& program ) {
+			Program original;
+			if( validator.getMode() != Validator::Off ) {
+				original = program;
+			}
+			for( Pass& pass : passes ) {
+				if( pass.run == nullptr || !this->isEnabled(pass) ) {
+					continue;
+				}
+				if( !timing ) {
+					pass.run(program);
+					continue;
+				}
+				size_t before = program.size();
+				auto start = std::chrono::steady_clock::now();
+				pass.run(program);
+				this->record(pass, start, before, program.size());
+			}
+			if( validator.getMode() != Validator::Off ) {
+				validator.check(original, program);
+			}
+			strip(program);
+		}
+
+		/// Run by the Compiler after lowering, which is where runs get folded
+		void recordFold( std::chrono::steady_clock::time_point start, size_t commands, size_t instructions ) {
+			if( timing ) {
+				this->record(this->find("fold"), start, commands, instructions);
+			}
+		}
+
+		/// A table of the time spent in each pass and how many instructions it removed
+		std::string report() {
+			std::stringstream out;
+			out << "Pass\t\tTime (ms)\tInstructions\n";
+			for( const Pass& pass : passes ) {
+				if( !this->isEnabled(pass) || !timing ) {
+					out << pass.name << (strlen(pass.name) < 8? "\t\t" : "\t") << (this->isEnabled(pass)? "on" : "-") << "\n";
+					continue;
+				}
+				out << pass.name << (strlen(pass.name) < 8? "\t\t" : "\t") << pass.seconds * 1000 << "\t\t"
+					<< pass.before << " -> " << pass.after << "\n";
+			}
+			if( this->isEnabled(this->find("rules")) ) {
+				out << rules->report();
+			}
+			if( validator.getMode() != Validator::Off ) {
+				out << validator.report();
+			}
+			return out.str();
+		}
+
+	private:
+		Pass& find( const std::string& name ) {
+			for( Pass& pass : passes ) {
+				if( name == pass.name )
+					return pass;
+			}
+			throw std::invalid_argument("No optimisation pass called " + name);
+		}
+		bool isEnabled( const Pass& pass ) {
+			return pass.forced == -1? level >= pass.level : pass.forced == 1;
+		}
+		void record( Pass& pass, std::chrono::steady_clock::time_point start, size_t before, size_t after ) {
+			pass.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			pass.before += before;
+			pass.after += after;
+		}
+
+		/// Fences have done their job once the passes have run
+		static void strip( Program& program ) {
+			size_t kept = 0;
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op != Op::Fence && program[i].op != Op::Blank )
+					program[kept++] = program[i];
+			}
+			program.resize(kept);
+		}
+
+		/// Work out the effect of one iteration of a loop body made of nothing but Add and Move
+		/// @param deltas Receives the amount added to each cell, relative to the pointer at the '['
+		/// @return The net pointer movement
+		static long simulate( const Program& program, size_t begin, size_t end, std::map<long, long>& deltas ) {
+			long pointer = 0;
+			for( size_t i = begin; i < end; i++ ) {
+				if( program[i].op == Op::Move ) {
+					pointer += program[i].arg;
+				}else {
+					deltas[pointer + program[i].offset] += program[i].arg;
+				}
+			}
+			for( auto i = deltas.begin(); i != deltas.end(); ) {
+				if( (i->second & 0xFF) == 0 ) {
+					i = deltas.erase(i);
+				}else {
+					i++;
+				}
+			}
+			return pointer;
+		}
+
+		/// Offer every innermost loop made of Add and Move to rewrite, which either appends
+		/// a replacement to out and returns true, or returns false to keep the loop
+		template<typename F>
+		static void rewriteLoops( Program& program, F rewrite ) {
+			Program out;
+			out.reserve(program.size());
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op == Op::Open ) {
+					size_t j = i + 1;
+					while( j < program.size() && (program[j].op == Op::Add || program[j].op == Op::Move) )
+						j++;
+					if( j < program.size() && program[j].op == Op::Close ) {
+						std::map<long, long> deltas;
+						long move = simulate(program, i + 1, j, deltas);
+						if( rewrite(program[i], move, deltas, out) ) {
+							i = j;
+							continue;
+						}
+					}
+				}
+				out.push_back(program[i]);
+			}
+			program.swap(out);
+		}
+
+		/// The inverse of an odd number, modulo 256
+		static long inverse( long d ) {
+			long x = d;
+			for( int i = 0; i < 3; i++ ) // Each Newton step doubles the correct bits
+				x = (x * (2 - d * x)) & 0xFF;
+			return x;
+		}
+
+		/// [-] and friends become Set 0
+		static void clear( Program& program ) {
+			rewriteLoops(program, []( const Instruction& open, long move, std::map<long, long>& deltas, Program& out ) {
+				// Any odd step reaches 0 eventually, an even one might never
+				if( move != 0 || deltas.size() != 1 || deltas.count(0) == 0 || (deltas[0] & 1) == 0 )
+					return false;
+				out.push_back({ Op::Set, 0, open.source });
+				return true;
+			});
+		}
+
+		/// [>] and friends become a Scan
+		static void scan( Program& program ) {
+			rewriteLoops(program, []( const Instruction& open, long move, std::map<long, long>& deltas, Program& out ) {
+				if( move == 0 || !deltas.empty() )
+					return false;
+				out.push_back({ Op::Scan, move, open.source });
+				return true;
+			});
+		}
+
+		/// [+>], [->>] and friends, which change each cell the same way until they reach a zero, become a Map
+		static void map( Program& program ) {
+			rewriteLoops(program, []( const Instruction& open, long move, std::map<long, long>& deltas, Program& out ) {
+				if( move == 0 || deltas.size() != 1 || deltas.count(0) == 0 )
+					return false;
+				out.push_back({ Op::Map, deltas[0] & 0xFF, open.source, 0, move });
+				return true;
+			});
+		}
+
+		/// Turn a balanced loop, whose counter steps by d, into a MulAdd for every other cell it touches
+		/// The loop runs n times where n * d + counter = 0 modulo 256, so each cell gains -counter * delta / d
+		static bool unroll( const Instruction& open, long move, std::map<long, long>& deltas, Program& out, bool unit ) {
+			if( move != 0 || deltas.count(0) == 0 || (deltas[0] & 1) == 0 )
+				return false;
+			long d = deltas[0] & 0xFF;
+			if( (d == 1 || d == 0xFF) != unit )
+				return false;
+			long factor = (0x100 - inverse(d)) & 0xFF;
+			for( const auto& cell : deltas ) {
+				if( cell.first != 0 ) {
+					out.push_back({ Op::MulAdd, (cell.second * factor) & 0xFF, open.source, cell.first, 0 });
+				}
+			}
+			out.push_back({ Op::Set, 0, open.source });
+			return true;
+		}
+		/// Multiplication loops with a counter stepping by 1, like [->++>+<<]
+		static void multiply( Program& program ) {
+			rewriteLoops(program, []( const Instruction& open, long move, std::map<long, long>& deltas, Program& out ) {
+				return unroll(open, move, deltas, out, true);
+			});
+		}
+		/// [[-<+>]>] and [[->+<]<], once multiply has been through them, become a Shift
+		static void shift( Program& program ) {
+			Program out;
+			out.reserve(program.size());
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( i + 4 < program.size() && program[i].op == Op::Open && program[i + 4].op == Op::Close ) {
+					const Instruction& transfer = program[i + 1];
+					const Instruction& clear = program[i + 2];
+					const Instruction& step = program[i + 3];
+					if( step.op == Op::Move && (step.arg == 1 || step.arg == -1)
+							&& transfer.op == Op::MulAdd && transfer.offset == -step.arg && transfer.from == 0 && (transfer.arg & 0xFF) == 1
+							&& clear.op == Op::Set && clear.offset == 0 && clear.arg == 0 ) {
+						out.push_back({ Op::Shift, step.arg, program[i].source });
+						i += 4;
+						continue;
+					}
+				}
+				out.push_back(program[i]);
+			}
+			program.swap(out);
+		}
+
+		/// Loops with a counter stepping by any odd amount, like [--->+<], which rely on 8 bit wraparound
+		static void closedForm( Program& program ) {
+			rewriteLoops(program, []( const Instruction& open, long move, std::map<long, long>& deltas, Program& out ) {
+				return unroll(open, move, deltas, out, false);
+			});
+		}
+
+		/// Fold pointer movement into the offsets of the instructions after it,
+		/// only moving the pointer for real before anything that depends on where it is
+		static void offsets( Program& program ) {
+			Program out;
+			out.reserve(program.size());
+			long delta = 0;
+			size_t source = 0;
+			for( Instruction i : program ) {
+				switch( i.op ) {
+					case Op::Move:
+						delta += i.arg;
+						source = i.source;
+						continue;
+					case Op::MulAdd:
+						i.from += delta;
+						// Fall through
+					case Op::Add:
+					case Op::Set:
+					case Op::Output:
+					case Op::Input:
+						i.offset += delta;
+						out.push_back(i);
+						continue;
+					default:
+						break;
+				}
+				if( delta != 0 ) {
+					out.push_back({ Op::Move, delta, source });
+					delta = 0;
+				}
+				out.push_back(i);
+			}
+			if( delta != 0 ) {
+				out.push_back({ Op::Move, delta, source });
+			}
+			program.swap(out);
+		}
+
+		/// Global value numbering over each straight-line region of Add, Set, MulAdd and Move.
+		/// Every write gives its cell a new numbered value, which makes copies and repeated
+		/// arithmetic collapse, and the region is lowered again from the final value of each cell
+		static void gvn( Program& program ) {
+			Program out;
+			out.reserve(program.size());
+			for( size_t i = 0; i < program.size(); ) {
+				size_t end = i;
+				while( end < program.size() && isArithmetic(program[end].op) )
+					end++;
+				if( end - i > 1 ) {
+					numberRegion(program, i, end, out);
+					i = end;
+				}else {
+					out.push_back(program[i++]);
+				}
+			}
+			program.swap(out);
+		}
+
+		static bool isArithmetic( Op op ) {
+			return op == Op::Add || op == Op::Set || op == Op::MulAdd || op == Op::Move;
+		}
+
+		/// Follow the cells whose values are known through straight-line code, from a Set or a Blank.
+		/// Outputs of them become a Print, and writes to them are held back and done with one Set each
+		/// before anything that isn't arithmetic, so a run of code printing known text shrinks to a Print.
+		/// Only writes to the cell under the pointer are held, since anything else can stop the program off the end
+		/// of the tape, and everything held is done before such an instruction so none of it is lost when it does
+		static void constants( Program& program ) {
+			Program out;
+			out.reserve(program.size());
+			// Relative to the pointer at the last loop, -1 for a cell whose value is not known
+			std::map<long, long> known;
+			// Known cells that have been written to since the last flush
+			std::set<long> dirty;
+			// Where the first of the writes held back since the last flush came from
+			size_t held = 0;
+			bool blank = false;
+			long pointer = 0;
+			// What to print before anything else is output, and where the first of it came from
+			std::string text;
+			size_t printed = 0;
+			auto value = [&]( long o ) {
+				auto found = known.find(o);
+				return found != known.end()? found->second : blank? 0 : -1;
+			};
+			// A cell that was only known to be blank may be off the tape, unless it is under the pointer
+			auto reached = [&]( long o ) {
+				return o == pointer || known.count(o);
+			};
+			auto flush = [&]() {
+				for( long o : dirty )
+					out.push_back({ Op::Set, known[o], held, o - pointer });
+				dirty.clear();
+				if( !text.empty() ) {
+					out.push_back({ Op::Print, (long)program.texts.size(), printed });
+					program.texts.push_back(text);
+					text.clear();
+				}
+			};
+			auto hold = [&]( const Instruction& i, long o ) {
+				if( o != pointer ) {
+					flush();
+					out.push_back({ Op::Set, known[o], i.source, i.offset });
+					return;
+				}
+				if( dirty.empty() )
+					held = i.source;
+				dirty.insert(o);
+			};
+			for( const Instruction& i : program ) {
+				long o = pointer + i.offset;
+				switch( i.op ) {
+					case Op::Output:
+						if( value(o) < 0 || !reached(o) ) {
+							flush();
+							break;
+						}
+						if( text.empty() )
+							printed = i.source;
+						text += (char)value(o);
+						continue;
+					case Op::Add:
+						if( value(o) < 0 ) {
+							if( i.offset != 0 )
+								flush();
+							break;
+						}
+						known[o] = (value(o) + i.arg) & 0xFF;
+						hold(i, o);
+						continue;
+					case Op::Set:
+						known[o] = i.arg & 0xFF;
+						hold(i, o);
+						continue;
+					case Op::MulAdd: {
+						long from = reached(pointer + i.from)? value(pointer + i.from) : -1;
+						if( from >= 0 && ((from * i.arg) & 0xFF) == 0 ) { // Adds nothing, and a loop with a zero counter never reaches the cell
+							continue;
+						}
+						if( from >= 0 && value(o) >= 0 ) {
+							known[o] = (value(o) + from * i.arg) & 0xFF;
+							hold(i, o);
+						}else if( from >= 0 ) {
+							if( (from * i.arg) & 0xFF ) {
+								if( i.offset != 0 )
+									flush();
+								out.push_back({ Op::Add, (from * i.arg) & 0xFF, i.source, i.offset });
+							}
+						}else {
+							if( i.offset != 0 || i.from != 0 )
+								flush();
+							if( dirty.erase(o) )
+								out.push_back({ Op::Set, known[o], i.source, i.offset });
+							known[o] = -1;
+							out.push_back(i);
+						}
+						continue;
+					}
+					case Op::Move:
+						flush();
+						pointer += i.arg;
+						break;
+					case Op::Input:
+						flush();
+						known[o] = -1;
+						break;
+					case Op::Blank:
+						blank = true;
+						break;
+					default: // Loops and anything else that moves the pointer by an unknown amount
+						flush();
+						known.clear();
+						blank = false;
+						pointer = 0;
+						break;
+				}
+				out.push_back(i);
+			}
+			flush();
+			program.swap(out);
+		}
+
+		/// Runs of Outputs or Inputs on consecutive cells, which is what .>.>. and ,>,>, become once
+		/// offsets has been through them, move all their characters at once
+		static void blocks( Program& program ) {
+			Program out;
+			out.reserve(program.size());
+			for( size_t i = 0; i < program.size(); ) {
+				Op op = program[i].op;
+				size_t end = i + 1;
+				if( op == Op::Output || op == Op::Input ) {
+					while( end < program.size() && program[end].op == op && program[end].offset == program[end - 1].offset + 1 )
+						end++;
+				}
+				if( end - i < 2 ) {
+					out.push_back(program[i++]);
+					continue;
+				}
+				long length = end - i;
+				if( op == Op::Output ) {
+					out.push_back({ Op::WriteBlock, length, program[i].source, program[i].offset });
+				}else {
+					// The Inputs stay behind it, for when there isn't enough input for all of them at once
+					out.push_back({ Op::ReadBlock, length, program[i].source, program[i].offset });
+					out.insert(out.end(), program.begin() + i, program.begin() + end);
+				}
+				i = end;
+			}
+			program.swap(out);
+		}
+
+		/// A loop whose body always leaves its counter at zero, like [>+<[-]], runs at most once.
+		/// Its Close becomes an EndIf, which link() removes, leaving the Open as a forward branch
+		static void branches( Program& program ) {
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op != Op::Close ) {
+					continue;
+				}
+				size_t begin = i;
+				while( begin > 0 && isArithmetic(program[begin - 1].op) )
+					begin--;
+				ValueTable table;
+				long delta;
+				std::map<long, size_t> cells = number(program, begin, i, table, delta);
+				auto counter = cells.find(delta);
+				if( counter != cells.end() && counter->second == table.constant(0) ) {
+					program[i].op = Op::EndIf;
+				}
+			}
+		}
+
+		/// Lower the region between begin and end from its value numbers, if that comes out shorter
+		/// The value numbers of the cells written by a straight-line region of Add, Set, MulAdd and Move
+		/// @param delta Receives the net pointer movement
+		static std::map<long, size_t> number( const Program& program, size_t begin, size_t end, ValueTable& table, long& delta ) {
+			std::map<long, size_t> cells;
+			auto cell = [&]( long o ) {
+				auto found = cells.find(o);
+				return found != cells.end()? found->second : table.entry(o);
+			};
+			delta = 0;
+			for( size_t i = begin; i < end; i++ ) {
+				const Instruction& ins = program[i];
+				long o = delta + ins.offset;
+				switch( ins.op ) {
+					case Op::Add:
+						cells[o] = table.add(cell(o), table.constant(1), ins.arg);
+						break;
+					case Op::Set:
+						cells[o] = table.constant(ins.arg);
+						break;
+					case Op::MulAdd:
+						cells[o] = table.add(cell(o), cell(delta + ins.from), ins.arg);
+						break;
+					default: // Move
+						delta += ins.arg;
+						break;
+				}
+			}
+			return cells;
+		}
+
+		static void numberRegion( const Program& program, size_t begin, size_t end, Program& out ) {
+			ValueTable table;
+			long delta;
+			std::map<long, size_t> cells = number(program, begin, end, table, delta);
+
+			// Only cells whose value changed need writing
+			std::map<long, Value> writes;
+			for( const auto& c : cells ) {
+				if( c.second != table.entry(c.first) ) {
+					writes[c.first] = table[c.second];
+				}
+			}
+			// A cell has to be written after every other cell that reads its entry value
+			std::map<long, size_t> readers;
+			for( const auto& w : writes ) {
+				for( const auto& term : w.second.terms ) {
+					if( term.first != w.first && writes.count(term.first) ) {
+						readers[term.first]++;
+					}
+				}
+			}
+			size_t source = program[begin].source;
+			Program lowered;
+			bool lowerable = true;
+			while( !writes.empty() ) {
+				auto next = writes.begin();
+				while( next != writes.end() && readers[next->first] != 0 )
+					next++;
+				if( next == writes.end() ) { // Cells reading each other, like a swap, would need a temporary
+					lowerable = false;
+					break;
+				}
+				long o = next->first;
+				const Value v = next->second;
+				long self = v.terms.count(o)? v.terms.at(o) : 0;
+				if( self == 0 ) {
+					lowered.push_back({ Op::Set, v.constant, source, o });
+				}else {
+					if( self != 1 ) {
+						lowered.push_back({ Op::MulAdd, (self - 1) & 0xFF, source, o, o });
+					}
+					if( v.constant != 0 ) {
+						lowered.push_back({ Op::Add, v.constant, source, o });
+					}
+				}
+				for( const auto& term : v.terms ) {
+					if( term.first != o ) {
+						lowered.push_back({ Op::MulAdd, term.second, source, o, term.first });
+						if( writes.count(term.first) )
+							readers[term.first]--;
+					}
+				}
+				writes.erase(next);
+			}
+			if( delta != 0 ) {
+				lowered.push_back({ Op::Move, delta, program[end - 1].source });
+			}
+			if( lowerable && lowered.size() < end - begin ) {
+				out.insert(out.end(), lowered.begin(), lowered.end());
+			}else {
+				out.insert(out.end(), program.begin() + begin, program.begin() + end);
+			}
+		}
+	};
+
+	/// Turns Brainfuck source into a Program
+	/// Runs of + - and < > are folded into a single instruction, the enabled passes are run,
+	/// and all jumps are resolved ahead of time.
+	/// Programs can also be compiled lazily, a chunk at a time: large loops are left as stubs pointing
+	/// back into the source, and are only compiled once execution actually reaches them
+	class Compiler {
+		PassManager passes;
+		bool folding = true;
+		bool debugging = false;
+
+	public:
+		/// Loops spanning more characters than this are left as stubs when compiling lazily
+		static const size_t lazy_threshold = 1024;
+		/// Lazily compiled top-level code is split into chunks of roughly this many characters
+		static const size_t chunk_size = 65536;
+
+		/// The passes run on everything this compiles
+		PassManager& getPasses() {
+			return passes;
+		}
+
+		/// Whether to compile '#' to a Debug instruction, instead of ignoring it like any other comment
+		void setDebugging( bool d ) {
+			debugging = d;
+		}
+
+		/// Compile the whole program at once
+		/// @param code The source code to compile
+		/// @throws std::invalid_argument if the brackets are unbalanced
+		Program compile( const std::string& code ) {
+			Program program;
+			auto start = std::chrono::steady_clock::now();
+			folding = passes.enabled("fold");
+			if( passes.getZeroTape() ) {
+				program.push_back({ Op::Blank });
+			}
+			size_t commands = this->lower(code, 0, code.length(), false, program);
+			this->finish(program, start, commands);
+			return program;
+		}
+
+		/// Compile the chunk of top-level code starting at begin
+		/// The chunk ends in a Halt at the end of the code, or in a Lazy stub for the next chunk.
+		/// A chunk starting with a large loop is just a LazyLoop stub for it
+		/// @throws std::invalid_argument if the brackets are unbalanced
+		Program compileTail( const std::string& code, size_t begin ) {
+			Program program;
+			auto start = std::chrono::steady_clock::now();
+			folding = passes.enabled("fold");
+			if( begin == 0 && passes.getZeroTape() ) {
+				program.push_back({ Op::Blank });
+			}
+			size_t commands = 0;
+			size_t i = begin;
+			while( i < code.length() ) {
+				if( i - begin >= chunk_size ) {
+					break;
+				}
+				if( code[i] == ']' ) {
+					throw std::invalid_argument("Unmatched ']' at " + std::to_string(i));
+				}
+				if( code[i] != '[' ) {
+					commands += this->lowerOne(code, i, program);
+					i++;
+					continue;
+				}
+				size_t end = matchLoop(code, i, lazy_threshold);
+				if( end == std::string::npos ) {
+					if( commands == 0 ) {
+						end = loopEnd(code, i);
+						program.push_back({ Op::LazyLoop, (long)end, i });
+						i = end + 1;
+					}
+					break; // Leave the rest for the next chunk
+				}
+				commands += this->lower(code, i, end + 1, false, program);
+				i = end + 1;
+			}
+			if( i < code.length() ) {
+				program.push_back({ Op::Lazy, 0, i });
+			}else {
+				program.push_back({ Op::Halt, 0, code.length() });
+			}
+			this->finish(program, start, commands);
+			return program;
+		}
+
+		/// Compile the loop stubbed by a LazyLoop
+		/// @param begin The position of the '['
+		/// @param end The position of the matching ']'
+		Program compileLoop( const std::string& code, size_t begin, size_t end ) {
+			Program program;
+			auto start = std::chrono::steady_clock::now();
+			folding = passes.enabled("fold");
+			size_t commands = this->lower(code, begin, end + 1, true, program);
+			this->finish(program, start, commands);
+			return program;
+		}
+
+		/// Resolve the jump targets of every Open, Close and Intrinsic, and remove EndIfs
+		/// @throws std::invalid_argument if the brackets are unbalanced
+		static void link( Program& program ) {
+			std::stack<size_t> open;
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op == Op::Open ) {
+					open.push(i);
+				}else if( program[i].op == Op::Close || program[i].op == Op::EndIf ) {
+					if( open.empty() ) {
+						throw std::invalid_argument("Unmatched ']' at " + std::to_string(program[i].source));
+					}
+					// Both jumps land just past their partner
+					program[open.top()].target = i + 1;
+					program[i].target = open.top() + 1;
+					open.pop();
+				}
+			}
+			if( !open.empty() ) {
+				throw std::invalid_argument("Unmatched '[' at " + std::to_string(program[open.top()].source));
+			}
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op != Op::Intrinsic ) {
+					continue;
+				}
+				// Past the code it stands in for, which the passes keep from mixing with what follows
+				size_t end = program[i].target, next = i + 1;
+				while( next < program.size() && program[next].source <= end )
+					next++;
+				program[i].target = next;
+			}
+			// An EndIf never jumps, so it can go once its Open knows where to jump to
+			std::vector<size_t> index(program.size() + 1);
+			size_t kept = 0;
+			for( size_t i = 0; i < program.size(); i++ ) {
+				index[i] = kept;
+				if( program[i].op != Op::EndIf )
+					kept++;
+			}
+			index[program.size()] = kept;
+			if( kept == program.size() ) {
+				return;
+			}
+			kept = 0;
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op == Op::EndIf ) {
+					continue;
+				}
+				if( program[i].op == Op::Open || program[i].op == Op::Close || program[i].op == Op::Intrinsic )
+					program[i].target = index[program[i].target];
+				program[kept++] = program[i];
+			}
+			program.resize(kept);
+		}
+
+		/// Find the ']' matching the '[' at i, looking no further than limit characters ahead
+		/// @return The position of the ']', or std::string::npos if it was not found
+		static size_t matchLoop( const std::string& code, size_t i, size_t limit ) {
+			size_t stop = limit < code.length() - i? i + limit : code.length();
+			size_t depth = 0;
+			for( ; i < stop; i++ ) {
+				if( code[i] == '[' ) {
+					depth++;
+				}else if( code[i] == ']' && --depth == 0 ) {
+					return i;
+				}
+			}
+			return std::string::npos;
+		}
+
+	private:
+		/// Run the passes over a lowered chunk and link it
+		void finish( Program& program, std::chrono::steady_clock::time_point start, size_t commands ) {
+			if( folding ) {
+				passes.recordFold(start, commands, program.size());
+			}
+			passes.run(program);
+			link(program);
+		}
+
+		/// Find the ']' matching the '[' at i
+		/// @throws std::invalid_argument if there is none
+		static size_t loopEnd( const std::string& code, size_t i ) {
+			size_t end = Interpreter::skipLoop(code, i);
+			if( end == code.length() ) {
+				throw std::invalid_argument("Unmatched '[' at " + std::to_string(i));
+			}
+			return end;
+		}
+
+		/// Lower the code between begin and end
+		/// @param lazy Whether to stub out large loops
+		/// @return The number of commands lowered
+		size_t lower( const std::string& code, size_t begin, size_t end, bool lazy, Program& program ) {
+			size_t commands = 0;
+			for( size_t i = begin; i < end; i++ ) {
+				if( lazy && code[i] == '[' && i != begin && matchLoop(code, i, lazy_threshold) == std::string::npos ) {
+					size_t close = loopEnd(code, i);
+					program.push_back({ Op::LazyLoop, (long)close, i });
+					i = close;
+					continue;
+				}
+				commands += this->lowerOne(code, i, program);
+			}
+			return commands;
+		}
+
+		/// Lower the single character at i
+		/// @return Whether it was a command
+		bool lowerOne( const std::string& code, size_t i, Program& program ) {
+			switch( code[i] ) {
+				case '+':
+				case '-':
+					this->fold(program, Op::Add, code[i] == '+'? 1 : -1, i);
+					return true;
+				case '>':
+				case '<':
+					this->fold(program, Op::Move, code[i] == '>'? 1 : -1, i);
+					return true;
+				case '.':
+					program.push_back({ Op::Output, 0, i });
+					return true;
+				case ',':
+					program.push_back({ Op::Input, 0, i });
+					return true;
+				case '[':
+					program.push_back({ Op::Open, 0, i });
+					return true;
+				case ']':
+					program.push_back({ Op::Close, 0, i });
+					return true;
+#ifndef QUICKFUCK_NO_DEBUG_HOOK
+				case '#':
+					if( !debugging )
+						return false;
+					program.push_back({ Op::Debug, 0, i });
+					return true;
+#endif
+			}
+			return false;
+		}
+
+		/// Merge an Add or Move into the previous instruction when folding is enabled
+		void fold( Program& program, Op op, long arg, size_t source ) {
+			if( !program.empty() && program.back().op == op && folding ) {
+				program.back().arg += arg;
+				if( op == Op::Add? (program.back().arg & 0xFF) == 0 : program.back().arg == 0 ) // "+-" and "<>" cancel out
+					program.pop_back();
+				return;
+			}
+			program.push_back({ op, arg, source });
+		}
+	};
+
+	/// The SIMD loops behind Scan and Map, built for each instruction set the compiler can target.
+	/// The best set the CPU supports is picked the first time they are used, so one build runs well everywhere
+	struct Kernels {
+		/// Add delta to every stride-th cell from cell onwards, a whole vector at a time, until one of them is zero
+		/// or the next vector wouldn't fit in the tape
+		/// @return The first cell it didn't get to, for the caller to carry on from one at a time
+		typedef long (*Walk)( unsigned char* bytes, long size, long cell, long stride, unsigned char delta );
+
+		const char* name;
+		Walk walk;
+		bool supported;
+
+		/// Every set built in, from slowest to fastest
+		static const std::vector<Kernels>& all() {
+			static const std::vector<Kernels> kernels = {
+				{ "scalar", &walkScalar, true },
+#ifdef QUICKFUCK_X86
+				{ "sse2", &walkSSE2, cpu("sse2") },
+				{ "avx2", &walkAVX2, cpu("avx2") },
+				{ "avx512", &walkAVX512, cpu("avx512bw") }
+#endif
+			};
+			return kernels;
+		}
+
+		/// The fastest set the CPU supports
+		static const Kernels& best() {
+			static const Kernels& chosen = pick();
+			return chosen;
+		}
+
+		/// @throws std::invalid_argument if there is no set with that name, or the CPU doesn't support it
+		static const Kernels& find( const std::string& name ) {
+			for( const Kernels& k : all() ) {
+				if( name != k.name ) {
+					continue;
+				}
+				if( !k.supported ) {
+					throw std::invalid_argument("This CPU does not support " + name);
+				}
+				return k;
+			}
+			throw std::invalid_argument("No kernels for " + name);
+		}
+
+	private:
+		static const Kernels& pick() {
+			const Kernels* chosen = &all()[0];
+			for( const Kernels& k : all() ) {
+				if( k.supported )
+					chosen = &k;
+			}
+			return *chosen;
+		}
+
+		static long walkScalar( unsigned char*, long, long cell, long, unsigned char ) {
+			return cell;
+		}
+
+#ifdef QUICKFUCK_X86
+		static bool cpu( const char* feature ) {
+			__builtin_cpu_init();
+			// __builtin_cpu_supports only takes a literal
+			if( strcmp(feature, "sse2") == 0 )
+				return __builtin_cpu_supports("sse2");
+			if( strcmp(feature, "avx2") == 0 )
+				return __builtin_cpu_supports("avx2");
+			return __builtin_cpu_supports("avx512bw");
+		}
+
+		/// Which lanes of a vector of width cells a walk with this stride visits, and what it adds to each
+		/// @param step Receives how far to move on after each vector
+		/// @return A bit for each lane visited, or 0 if the stride is longer than the vector
+		static uint64_t lanes( long stride, unsigned char delta, long width, unsigned char* add, long& step ) {
+			long distance = labs(stride);
+			if( distance > width ) {
+				return 0;
+			}
+			step = ((width - 1) / distance + 1) * distance;
+			if( distance == 1 ) {
+				memset(add, delta, width);
+				return width == 64? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+			}
+			uint64_t visited = 0;
+			memset(add, 0, width);
+			for( long l = 0; l < width; l += distance ) {
+				long lane = stride > 0? l : width - 1 - l;
+				visited |= (uint64_t)1 << lane;
+				add[lane] = delta;
+			}
+			return visited;
+		}
+
+		__attribute__((target("sse2")))
+		static long walkSSE2( unsigned char* bytes, long size, long cell, long stride, unsigned char delta ) {
+			unsigned char add[16];
+			long step;
+			uint64_t visited = lanes(stride, delta, 16, add, step);
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i adds = _mm_loadu_si128((const __m128i*)add);
+			while( visited != 0 && (stride > 0? cell + 16 <= size : cell >= 15) ) {
+				__m128i* block = (__m128i*)(bytes + (stride > 0? cell : cell - 15));
+				__m128i cells = _mm_loadu_si128(block);
+				if( (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(cells, zero)) & visited )
+					break;
+				if( delta != 0 )
+					_mm_storeu_si128(block, _mm_add_epi8(cells, adds));
+				cell += stride > 0? step : -step;
+			}
+			return cell;
+		}
+
+		__attribute__((target("avx2")))
+		static long walkAVX2( unsigned char* bytes, long size, long cell, long stride, unsigned char delta ) {
+			unsigned char add[32];
+			long step;
+			uint64_t visited = lanes(stride, delta, 32, add, step);
+			const __m256i zero = _mm256_setzero_si256();
+			const __m256i adds = _mm256_loadu_si256((const __m256i*)add);
+			while( visited != 0 && (stride > 0? cell + 32 <= size : cell >= 31) ) {
+				__m256i* block = (__m256i*)(bytes + (stride > 0? cell : cell - 31));
+				__m256i cells = _mm256_loadu_si256(block);
+				if( (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, zero)) & visited )
+					break;
+				if( delta != 0 )
+					_mm256_storeu_si256(block, _mm256_add_epi8(cells, adds));
+				cell += stride > 0? step : -step;
+			}
+			return cell;
+		}
+
+		__attribute__((target("avx512f,avx512bw")))
+		static long walkAVX512( unsigned char* bytes, long size, long cell, long stride, unsigned char delta ) {
+			unsigned char add[64];
+			long step;
+			uint64_t visited = lanes(stride, delta, 64, add, step);
+			const __m512i zero = _mm512_setzero_si512();
+			const __m512i adds = _mm512_loadu_si512(add);
+			while( visited != 0 && (stride > 0? cell + 64 <= size : cell >= 63) ) {
+				unsigned char* block = bytes + (stride > 0? cell : cell - 63);
+				__m512i cells = _mm512_loadu_si512(block);
+				if( _mm512_cmpeq_epi8_mask(cells, zero) & visited )
+					break;
+				if( delta != 0 )
+					_mm512_storeu_si512(block, _mm512_add_epi8(cells, adds));
+				cell += stride > 0? step : -step;
+			}
+			return cell;
+		}
+#endif
+	};
+
+	/// The "compiled" interpreter, which runs a Program instead of the raw source
+	/// Every operation has a stencil, a handler function compiled ahead of time along with the library.
+	/// Compiling copies the stencil for each instruction and patches in its operands and jump target,
+	/// so execution is one indirect call per instruction rather than a switch per source character.
+	/// Large loops are compiled lazily, the first time they are entered, unless setLazy(false) is used.
+	/// Like the performance interpreter, the tape is fixed in size. Every stencil checks the cells it uses,
+	/// and stops with Status::OutOfBounds before touching anything if one is off the tape
+	class CompiledInterpreter : public Interpreter {
+		struct Stencil;
+		/// Runs one stencil, and returns the index of the next one
+		typedef size_t (*Handler)( CompiledInterpreter&, const Stencil&, size_t );
+		struct Stencil {
+			Handler run;
+			long imm;
+			long offset;
+			long from;
+			size_t target;
+		};
+
+		unsigned char* bytes;
+		size_t size;
+		Compiler compiler;
+		Program program;
+		std::vector<Stencil> stencils;
+		size_t pc = 0;
+		bool lazy = true;
+		const Kernels* kernels = &Kernels::best();
+		/// Set by stencils that stop the program early, along with pc
+		Status status = Status::Ok;
+		/// Set when the compiler settings or the code may have changed, so the next reset recompiles
+		bool stale = false;
+
+		/// Returned by stencils that leave the next index in pc instead, to get out of the run loop
+		static const size_t stop = (size_t)-1;
+
+	public:
+		/// @param s The source code to build from
+		/// @param width The width/length of the tape
+		CompiledInterpreter( std::string s, size_t width ) : Interpreter(std::move(s)), size(width) {
+			bytes = (unsigned char*)calloc(width, 1);
+		}
+		CompiledInterpreter( std::ifstream &f, size_t width ) : size(width) {
+			bytes = (unsigned char*)calloc(width, 1);
+			std::stringstream buff;
+			buff << f.rdbuf();
+			this->code = buff.str();
+		}
+		CompiledInterpreter( const CompiledInterpreter& ) = delete;
+		CompiledInterpreter& operator=( const CompiledInterpreter& ) = delete;
+		virtual ~CompiledInterpreter() {
+			free(bytes);
+		}
+
+		/// Interprets the code from the start
+		virtual std::string interpret() {
+			this->reset();
+			raise(this->run());
+			return output;
+		}
+		virtual std::string interpret( std::string in ) {
+			this->reset();
+			input = in;
+			raise(this->run());
+			return output;
+		}
+
+		/// Recompiles the code if it has changed, through getCode() or the compiler settings
+		virtual void reset() {
+			position = 0;
+			active_cell = 0;
+			pc = 0;
+			for( size_t i = 0; i < size; i++ ) {
+				bytes[i] = 0;
+			}
+			output = "";
+			input = "";
+			if( stale || stencils.empty() ) {
+				this->compile();
+			}
+		}
+
+		/// The code can be changed through the reference, so the next reset recompiles it
+		virtual std::string& getCode() {
+			stale = true;
+			return code;
+		}
+
+		/// Runs until the end of the program, or until something stops it
+		/// @param budget How many instructions to run at most
+		/// @throws std::invalid_argument if a lazily compiled part of the code has unbalanced brackets
+		virtual Status run( size_t budget = unlimited ) {
+			if( stencils.empty() ) {
+				this->compile();
+			}
+			status = Status::Ok;
+			while( pc < stencils.size() && status == Status::Ok ) {
+				// Compiling a stub can move the stencils, so they are reloaded whenever one gets out of the loop
+				const Stencil* s = stencils.data();
+				const size_t end = stencils.size();
+				size_t i = pc;
+				if( budget == unlimited && !progress ) {
+					while( i < end ) {
+						i = s[i].run(*this, s[i], i);
+					}
+				}else {
+					for( ; i < end && budget > 0; budget-- ) {
+						i = s[i].run(*this, s[i], i);
+						if( progress && --countdown == 0 ) {
+							// Stencils that stop leave the next index in pc
+							size_t at = i == stop? pc : i;
+							position = at < program.size()? program[at].source : code.length();
+							this->publish();
+						}
+					}
+				}
+				if( i != stop ) {
+					pc = i;
+				}
+				if( budget == 0 && status == Status::Ok && pc < stencils.size() ) {
+					status = Status::Budget;
+				}
+			}
+			position = pc < program.size()? program[pc].source : code.length();
+			return this->stopped(status);
+		}
+
+		/// Executes a single compiled instruction, which may cover several characters of source
+		virtual void step() {
+			raise(this->tryStep());
+		}
+		virtual Status tryStep() {
+			if( stencils.empty() ) {
+				this->compile();
+			}
+			status = Status::Ok;
+			if( pc < stencils.size() ) {
+				size_t next = stencils[pc].run(*this, stencils[pc], pc);
+				if( next != stop ) {
+					pc = next;
+				}
+			}
+			position = pc < program.size()? program[pc].source : code.length();
+			return status;
+		}
+
+		/// Turn lazy compilation on or off, which takes effect on the next reset
+		void setLazy( bool l ) {
+			lazy = l;
+			stale = true;
+		}
+
+		/// '#' is only compiled in while there is a hook, so it costs nothing otherwise. Takes effect on the next reset
+		virtual void setDebugHook( DebugHook h ) {
+			hook = h;
+			compiler.setDebugging((bool)h);
+			stale = true;
+		}
+
+		/// Swaps the stencil at the end of every loop, so there is nothing to check while there is no token
+		/// and it takes effect without recompiling. Only the token itself can be used from other threads while running
+		virtual void setCancellationToken( std::shared_ptr<CancellationToken> t ) {
+			token = t;
+			for( size_t i = 0; i < program.size(); i++ ) {
+				if( program[i].op == Op::Close ) {
+					stencils[i].run = this->handler(Op::Close);
+				}
+			}
+		}
+
+		/// Use a particular set of SIMD kernels instead of the fastest one the CPU supports
+		void setKernels( const Kernels& k ) {
+			kernels = &k;
+		}
+		const Kernels& getKernels() {
+			return *kernels;
+		}
+
+		/// The optimisation passes, which take effect on the next reset
+		PassManager& getPasses() {
+			stale = true;
+			return compiler.getPasses();
+		}
+
+		/// The compiled form of the code
+		/// With lazy compilation, this only covers the code that has been reached so far
+		const Program& getProgram() {
+			if( stale || stencils.empty() ) {
+				this->compile();
+			}
+			return program;
+		}
+
+		virtual std::vector<char> getTape() {
+			return std::vector<char>(bytes, bytes + size);
+		}
+		virtual char getValue(size_t i) {
+			return (char)bytes[i];
+		}
+		using Interpreter::getValue;
+		virtual char getValue() {
+			return (char)bytes[active_cell];
+		}
+		virtual void setValue(size_t i, char v) {
+			bytes[i] = v;
+		}
+		virtual void setValue(char v) {
+			bytes[active_cell] = v;
+		}
+		virtual size_t getSize() {
+			return size;
+		}
+		virtual Status setTape( const char* data, size_t n ) {
+			if( n > size ) {
+				return Status::OutOfBounds;
+			}
+			memcpy(bytes, data, n);
+			return Status::Ok;
+		}
+		virtual const char* getTapeData() {
+			return (const char*)bytes;
+		}
+
+	private:
+		/// Copy the stencil of every instruction and patch in its operands
+		void compile() {
+			program.clear();
+			program.layouts.clear();
+			program.texts.clear();
+			stencils.clear();
+			stale = false;
+			pc = 0;
+			this->append(lazy? compiler.compileTail(code, 0) : compiler.compile(code));
+		}
+
+		/// Add more compiled code to the end of the program
+		/// @param chunk Linked code, with jumps other than Open, Close and Intrinsic already pointing into the program
+		/// @return The index of the first new instruction
+		size_t append( const Program& chunk ) {
+			size_t base = program.size(), layouts = program.layouts.size(), texts = program.texts.size();
+			program.layouts.insert(program.layouts.end(), chunk.layouts.begin(), chunk.layouts.end());
+			program.texts.insert(program.texts.end(), chunk.texts.begin(), chunk.texts.end());
+			for( const Instruction& i : chunk ) {
+				program.push_back(i);
+				if( i.op == Op::Open || i.op == Op::Close || i.op == Op::Intrinsic ) {
+					program.back().target += base;
+				}
+				if( i.op == Op::Intrinsic ) {
+					program.back().arg += layouts;
+				}else if( i.op == Op::Print ) {
+					program.back().arg += texts;
+				}
+				stencils.push_back({ this->handler(i.op), program.back().arg, i.offset, i.from, program.back().target });
+			}
+			return base;
+		}
+
+		/// Replace the stub at pc with a jump to code compiled for it
+		void patch( size_t pc, size_t target ) {
+			program[pc].op = Op::Jump;
+			program[pc].target = target;
+			stencils[pc] = { &jump, 0, 0, 0, target };
+		}
+
+		/// The stencil for op, checking the cancellation token at the end of loops if there is one
+		Handler handler( Op op ) {
+			return op == Op::Close && token? &closeCancellable : stencilFor(op);
+		}
+
+		static Handler stencilFor( Op op ) {
+			switch( op ) {
+				case Op::Add: return &add;
+				case Op::Move: return &move;
+				case Op::Output: return &write;
+				case Op::Input: return &read;
+				case Op::Open: return &open;
+				case Op::Close: return &close;
+				case Op::Jump: return &jump;
+				case Op::Lazy: return &tail;
+				case Op::LazyLoop: return &loop;
+				case Op::Halt: return &halt;
+				case Op::Set: return &set;
+				case Op::MulAdd: return &mulAdd;
+				case Op::Scan: return &scan;
+				case Op::Shift: return &shift;
+				case Op::Map: return &map;
+				case Op::Print: return &print;
+				case Op::WriteBlock: return &writeBlock;
+				case Op::ReadBlock: return &readBlock;
+				case Op::Intrinsic: return &intrinsic;
+				case Op::Debug: return &debug;
+				case Op::EndIf: break; // Removed by link()
+				case Op::Fence: break; // Removed by the PassManager
+				case Op::Blank: break; // Removed by the PassManager
+			}
+			return nullptr;
+		}
+
+		/// Stop at pc, for stencils that check the bounds of the tape
+		size_t outOfBounds( size_t pc ) {
+			this->pc = pc;
+			status = Status::OutOfBounds;
+			return stop;
+		}
+		/// Whether the n cells from offset onwards, relative to the pointer, are all on the tape
+		bool fits( long offset, long n = 1 ) {
+			size_t cell = active_cell + offset;
+			return cell < size && (size_t)n <= size - cell;
+		}
+		/// The first zero cell every stride cells from the pointer on, or -1 if the tape ends first
+		long zero( long stride ) {
+			long cell = kernels->walk(bytes, (long)size, (long)active_cell, stride, 0);
+			for( ; cell >= 0 && cell < (long)size; cell += stride ) {
+				if( bytes[cell] == 0 )
+					return cell;
+			}
+			return -1;
+		}
+
+		// The stencils themselves
+		static size_t add( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.offset) ) {
+				return m.outOfBounds(pc);
+			}
+			m.bytes[m.active_cell + s.offset] += (unsigned char)s.imm;
+			return pc + 1;
+		}
+		/// Stays put if the move would go off the tape, so every other stencil can use the cell under the pointer
+		static size_t move( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			size_t cell = m.active_cell + s.imm;
+			if( cell >= m.size ) { // Moves left of the start wrap round to huge numbers too
+				return m.outOfBounds(pc);
+			}
+			m.active_cell = cell;
+			return pc + 1;
+		}
+		static size_t write( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.offset) ) {
+				return m.outOfBounds(pc);
+			}
+			m.output += (char)m.bytes[m.active_cell + s.offset];
+			return pc + 1;
+		}
+		static size_t print( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			m.output += m.program.texts[s.imm];
+			return pc + 1;
+		}
+		static size_t writeBlock( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.offset, s.imm) ) {
+				// Print the characters before the one off the tape, as the Outputs it stands in for would
+				for( long k = 0; m.fits(s.offset + k); k++ )
+					m.output += (char)m.bytes[m.active_cell + s.offset + k];
+				return m.outOfBounds(pc);
+			}
+			m.output.append((const char*)m.bytes + m.active_cell + s.offset, s.imm);
+			return pc + 1;
+		}
+		static size_t readBlock( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.offset, s.imm) || m.input.length() < (size_t)s.imm ) {
+				return pc + 1; // The Inputs after it read what there is, and stop where the input or the tape runs out
+			}
+			memcpy(m.bytes + m.active_cell + s.offset, m.input.data(), s.imm);
+			m.input.erase(0, s.imm);
+			return pc + 1 + s.imm;
+		}
+		static size_t read( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.offset) ) {
+				return m.outOfBounds(pc);
+			}
+			if( m.input.length() == 0 ) {
+				m.pc = pc; // So the read can be retried once there is more input
+				m.status = Status::NeedInput;
+				return stop;
+			}
+			m.bytes[m.active_cell + s.offset] = m.input[0];
+			m.input.erase(0, 1);
+			return pc + 1;
+		}
+		static size_t open( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			return m.bytes[m.active_cell] == 0? s.target : pc + 1;
+		}
+		static size_t close( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			return m.bytes[m.active_cell] != 0? s.target : pc + 1;
+		}
+		static size_t closeCancellable( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( m.bytes[m.active_cell] == 0 ) {
+				return pc + 1;
+			}
+			if( m.token->isCancelled() ) {
+				m.pc = s.target;
+				m.status = Status::Cancelled;
+				return stop;
+			}
+			return s.target;
+		}
+		static size_t jump( CompiledInterpreter&, const Stencil& s, size_t ) {
+			return s.target;
+		}
+		static size_t halt( CompiledInterpreter& m, const Stencil&, size_t ) {
+			m.pc = stop;
+			return stop;
+		}
+		static size_t set( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.offset) ) {
+				return m.outOfBounds(pc);
+			}
+			m.bytes[m.active_cell + s.offset] = (unsigned char)s.imm;
+			return pc + 1;
+		}
+		/// A loop turned into MulAdds only goes near their cells if its counter, from, isn't zero
+		static size_t mulAdd( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( !m.fits(s.from) ) {
+				return m.outOfBounds(pc);
+			}
+			if( m.bytes[m.active_cell + s.from] == 0 ) {
+				return pc + 1;
+			}
+			if( !m.fits(s.offset) ) {
+				return m.outOfBounds(pc);
+			}
+			m.bytes[m.active_cell + s.offset] += (unsigned char)(m.bytes[m.active_cell + s.from] * s.imm);
+			return pc + 1;
+		}
+		static size_t scan( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( m.bytes[m.active_cell] == 0 ) {
+				return pc + 1;
+			}
+			long end = m.zero(s.imm);
+			if( end < 0 ) {
+				return m.outOfBounds(pc);
+			}
+			m.active_cell = end;
+			return pc + 1;
+		}
+		static size_t debug( CompiledInterpreter& m, const Stencil&, size_t pc ) {
+			m.position = m.program[pc].source;
+			m.pc = pc + 1;
+			if( m.hook && m.hook(m) ) {
+				m.status = Status::Breakpoint;
+				return stop;
+			}
+			return pc + 1;
+		}
+		/// Falls back on the original code when the idiom's cells aren't all on the tape, which stops wherever it goes off
+		static size_t intrinsic( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			const std::vector<long>& cells = m.program.layouts[s.imm];
+			for( long cell : cells ) {
+				if( !m.fits(cell) ) {
+					return pc + 1;
+				}
+			}
+			return Intrinsics::run(s.from, m.bytes + m.active_cell, cells, m.output)? s.target : pc + 1;
+		}
+		static size_t shift( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			unsigned char* cell = m.bytes + m.active_cell;
+			if( *cell == 0 ) {
+				return pc + 1;
+			}
+			if( s.imm > 0 ) {
+				unsigned char* zero = (unsigned char*)memchr(cell, 0, m.size - m.active_cell);
+				if( m.active_cell == 0 || zero == nullptr ) {
+					return m.outOfBounds(pc);
+				}
+				size_t length = zero - cell;
+				cell[-1] += cell[0];
+				memmove(cell, cell + 1, length - 1);
+				cell[length - 1] = 0;
+				m.active_cell += length;
+			}else {
+				size_t zero = m.active_cell;
+				while( zero > 0 && m.bytes[zero] != 0 )
+					zero--;
+				if( m.active_cell + 1 >= m.size || m.bytes[zero] != 0 ) {
+					return m.outOfBounds(pc);
+				}
+				size_t length = m.active_cell - zero;
+				cell[1] += cell[0];
+				memmove(m.bytes + zero + 2, m.bytes + zero + 1, length - 1);
+				m.bytes[zero + 1] = 0;
+				m.active_cell = zero;
+			}
+			return pc + 1;
+		}
+		/// Finds the end before changing anything, so the tape is left as it was if that is off the tape
+		static size_t map( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			long end = m.zero(s.from);
+			if( end < 0 ) {
+				return m.outOfBounds(pc);
+			}
+			unsigned char delta = (unsigned char)s.imm;
+			long cell = m.kernels->walk(m.bytes, (long)m.size, (long)m.active_cell, s.from, delta);
+			for( ; cell != end; cell += s.from ) {
+				m.bytes[cell] += delta;
+			}
+			m.active_cell = end;
+			return pc + 1;
+		}
+		/// Compile the next chunk of top-level code
+		static size_t tail( CompiledInterpreter& m, const Stencil&, size_t pc ) {
+			size_t start = m.append(m.compiler.compileTail(m.code, m.program[pc].source));
+			m.patch(pc, start);
+			m.pc = start;
+			return stop;
+		}
+		/// Compile a loop the first time it is entered, then come back to pc + 1 once it is done
+		static size_t loop( CompiledInterpreter& m, const Stencil& s, size_t pc ) {
+			if( m.bytes[m.active_cell] == 0 ) {
+				return pc + 1;
+			}
+			size_t end = s.imm;
+			Program chunk = m.compiler.compileLoop(m.code, m.program[pc].source, end);
+			chunk.push_back({ Op::Jump, 0, end });
+			chunk.back().target = pc + 1;
+			size_t start = m.append(chunk);
+			m.patch(pc, start);
+			m.pc = start;
+			return stop;
+		}
 	};
-}
\ No newline at end of file
+}
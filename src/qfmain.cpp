@@ -1,285 +1,648 @@
 /*
 	QuickFuck, a lightweight C++ Brainfuck interpreter
-	Currently has Brainfuck::Interpreter and Brainfuck::PerformanceInterpreter
+	Runs Brainfuck::DynamicInterpreter, Brainfuck::PerformanceInterpreter or Brainfuck::CompiledInterpreter from the library
 	By Robonics
 */
 
 #include <iostream>
 #include <string>
-#include <stack>
-#include <vector>
 #include <fstream>
 #include <sstream>
-#include <math.h>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include "../lib/quickfuck.hpp"
 
-namespace Brainfuck {
-	/// Base/Abstract class
-	class Interpreter {
-	public:
-		virtual void interpret() {}
-		virtual void print() {}
-	};
+enum Flag {
+	Performance = 0b1,
+	Verbose = 0b10,
+	Expression = 0b100,
+	Compiled = 0b1000,
+	Pipe = 0b10000,
+	Parallel = 0b100000,
+	Ring = 0b1000000,
+	Bits = 0b10000000
+};
 
-	/// The most basic interpreter. Rather memory hefty, does not support negative cell coords
-	/// This interpreter is dynamically sized, and will grow as more cells are used
-	class DynamicInterpreter : public Interpreter {
-		std::vector<int> cells;
-		std::string code;
-		std::stack<int> loops;
-		size_t position;
-		size_t active_cell = 0;
-		std::string input_buffer;
+/// How many steps to run between writing out the output, so long running programs still print as they go
+static const size_t slice = 1u << 20;
 
-	public:
-		DynamicInterpreter() {}
-		/// @param s The source code
-		DynamicInterpreter( std::string s ) : code(s) {}
-		/// @param f The file to read from
-		DynamicInterpreter( std::ifstream &f ) {
-			std::stringstream buff;
-			buff << f.rdbuf();
-			this->code = buff.str();
-		}
+/// How much of a pipe to hand a stage at once, since each character read shifts the rest of its input along
+static const size_t chunk = 512;
 
-		/// Load from a string
-		/// @param s The string to load from
-		void load( std::string s ) {
-			this->code = s;
-		}
-		/// Load form a file
-		/// @param f The file to load from
-		void load( std::ifstream &f ) {
-			std::stringstream buff;
-			buff << f.rdbuf();
-			this->code = buff.str();
+/// A lock-free queue of bytes from one thread to one other, connecting the stages of a --pipe
+class ByteQueue {
+	static const size_t capacity = 1u << 16;
+
+	/// Only ever increase, and are masked to index bytes
+	/// Each side's variables are padded onto a cache line of their own, since new only honours alignas from C++17
+	std::atomic<size_t> head{0}; // Written by the reader
+	char head_line[64];
+	std::atomic<size_t> tail{0}; // Written by the writer
+	char tail_line[64];
+	std::atomic<bool> finished{false};
+	std::atomic<bool> closed{false};
+	char flag_line[64];
+	char bytes[capacity];
+
+	/// Spin for a while when the other side is behind, and only give up the CPU if it stays that way
+	static void wait( unsigned& spins ) {
+		if( ++spins < 1024 ) {
+#ifdef QUICKFUCK_X86
+			_mm_pause();
+#endif
+		}else {
+			std::this_thread::yield();
 		}
+	}
 
-		/// Interpret the code from the beginning
-		virtual void interpret() {
-			position = 0;
-			// Initilize the tape
-			cells = { 0 };
-			while( position < code.length() ) {
-				switch( code[position] ) {
-					case '+':
-						cells[active_cell]++;
-						break;
-					case '-':
-						cells[active_cell]--;
-						break;
-					case '<':
-						if(active_cell > 0) // No negative
-							active_cell--;
-						break;
-					case '>':
-						if( active_cell == cells.size() -1 )
-							cells.emplace_back(0);
-						active_cell++;
-						break;
-					case '[':
-						loops.push(position);
-						break;
-					case ']':
-						if( cells[active_cell] == 0 ) {
-							loops.pop();
-						}else {
-							position = loops.top();
-						}
-						break;
-					case '.':
-						std::cout << (char)(cells[active_cell]);
-						break;
-					case ',':
-						if( input_buffer.length() == 0 ) {
-							std::string i;
-							std::getline(std::cin, i);
-							input_buffer += i;
-						}
-						cells[active_cell] = (int)(input_buffer[0]);
-						input_buffer.erase(0, 1);
-						break;
-					case '#':
-						std::cout << "Debug:\n";
-						this->print();
-				}
-				position++;
+public:
+	/// Write all of s, waiting for room when the queue is full
+	/// @return false if the reader has stopped, in which case the rest is dropped
+	bool write( const std::string& s ) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		unsigned spins = 0;
+		for( size_t done = 0; done < s.length(); ) {
+			if( closed.load(std::memory_order_acquire) ) {
+				return false;
 			}
-			std::cout << std::flush;
+			size_t room = capacity - (t - head.load(std::memory_order_acquire));
+			if( room == 0 ) {
+				wait(spins);
+				continue;
+			}
+			size_t n = std::min(room, s.length() - done);
+			size_t at = t & (capacity - 1);
+			size_t first = std::min(n, capacity - at);
+			memcpy(bytes + at, s.data() + done, first);
+			memcpy(bytes, s.data() + done + first, n - first);
+			t += n;
+			done += n;
+			tail.store(t, std::memory_order_release);
+			spins = 0;
 		}
+		return true;
+	}
 
-		/// Print the value of all the cells
-		virtual void print() {
-			std::cout << "Cell\tVal\tChar\n";
-			for(size_t i = 0; i < cells.size(); i++) {
-				std::cout << i << ":\t" << cells[i] << "\t'" << (char)cells[i] << "'\n";
+	/// Take up to max bytes, waiting for something to arrive when the queue is empty
+	/// @return false if the writer has finished and there is nothing left to read
+	bool read( std::string& s, size_t max ) {
+		size_t h = head.load(std::memory_order_relaxed);
+		unsigned spins = 0;
+		while( true ) {
+			// Checked before the tail, so nothing written before finishing can be missed
+			bool done = finished.load(std::memory_order_acquire);
+			size_t t = tail.load(std::memory_order_acquire);
+			if( t != h ) {
+				size_t n = std::min(t - h, max);
+				size_t at = h & (capacity - 1);
+				size_t first = std::min(n, capacity - at);
+				s.append(bytes + at, first);
+				s.append(bytes, n - first);
+				head.store(h + n, std::memory_order_release);
+				return true;
 			}
-			std::cout << std::endl;
+			if( done ) {
+				return false;
+			}
+			wait(spins);
 		}
-	};
+	}
 
-	/// This is the "performance" version of the interpreter, in that it uses marginally less memory
-	/// This is not dynamically sized, nor does it support negative cell keys
-	class PerformanceInterpreter : public Interpreter {
-		unsigned char* bytes;
-		size_t position;
-		std::stack<size_t> loops;
-		size_t active_cell;
-		size_t size;
-		std::string code;
-		std::string input;
-	public:
-		/// @param s The source code to build from
-		/// @param width The width/length of the tape
-		PerformanceInterpreter( std::string s, size_t width ) : code(s), size(width) {
-			bytes = (unsigned char*)malloc(width);
-			// Zero bytes
-			for(size_t i = 0; i < width; i++) {
-				bytes[i] = 0;
-			}
+	/// Called by the writer once it will write nothing more
+	void finish() {
+		finished.store(true, std::memory_order_release);
+	}
+	/// Called by the reader once it will read nothing more
+	void close() {
+		closed.store(true, std::memory_order_release);
+	}
+};
+
+/// A file mapped into memory, for --tape-in
+class Mapping {
+	void* data = MAP_FAILED;
+	size_t size = 0;
+public:
+	/// @throws std::runtime_error if the file can't be opened or mapped
+	Mapping( const std::string& path ) {
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat info;
+		if( fd < 0 || fstat(fd, &info) != 0 ) {
+			throw std::runtime_error("File " + path + " not found");
+		}
+		size = info.st_size;
+		// mmap refuses empty files, which are an empty tape anyway
+		if( size > 0 ) {
+			data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		::close(fd);
+		if( size > 0 && data == MAP_FAILED ) {
+			throw std::runtime_error("Could not map " + path);
+		}
+		if( size > 0 ) {
+			madvise(data, size, MADV_SEQUENTIAL); // It is only read once, from start to end
+		}
+	}
+	Mapping( const Mapping& ) = delete;
+	Mapping& operator=( const Mapping& ) = delete;
+	~Mapping() {
+		if( data != MAP_FAILED ) {
+			munmap(data, size);
+		}
+	}
+
+	const char* getData() {
+		return size > 0? (const char*)data : "";
+	}
+	size_t getSize() {
+		return size;
+	}
+};
+
+/// Write out the whole tape in one go, for --tape-out
+/// @return Whether it was written
+bool dump( Brainfuck::Interpreter& interp, const std::string& path ) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if( fd < 0 ) {
+		return false;
+	}
+	const char* data = interp.getTapeData();
+	size_t left = interp.getSize();
+	// Bit tapes are written a cell to a byte as well
+	std::vector<char> cells;
+	if( !data ) {
+		cells = interp.getTape();
+		data = cells.data();
+	}
+	// Only goes round again if the write is cut short
+	while( left > 0 ) {
+		ssize_t n = write(fd, data, left);
+		if( n <= 0 ) {
+			::close(fd);
+			return false;
 		}
-		PerformanceInterpreter( std::ifstream &f, size_t width ) : size(width) {
-			bytes = (unsigned char*)malloc(width);
-			// Zero bytes
-			for(size_t i = 0; i < width; i++) {
-				bytes[i] = 0;
+		data += n;
+		left -= n;
+	}
+	return ::close(fd) == 0;
+}
+
+/// The interpreter and options picked on the command line
+struct Engine {
+	int flags = 0;
+	size_t cell_n = 256u;
+	/// Optimiser options, given to the PassManager of each compiled interpreter
+	std::vector<std::string> options = { "--zero-tape" }; // The tape is only ever run from a reset
+	const Brainfuck::Kernels* kernels = nullptr;
+	bool lazy = true;
+	/// The file to keep the tape in, for --tape-file
+	std::string file = "";
+
+	/// @throws std::invalid_argument if a rule file has gone missing since the options were checked
+	/// @throws std::runtime_error if the tape file can't be used
+	std::unique_ptr<Brainfuck::Interpreter> build( const std::string& code ) {
+		if( flags & Flag::Compiled ) {
+			Brainfuck::CompiledInterpreter* compiled = new Brainfuck::CompiledInterpreter( code, cell_n );
+			std::unique_ptr<Brainfuck::Interpreter> interp(compiled);
+			// Each interpreter gets passes and rules of its own, so pipe stages can compile at the same time
+			for( const std::string& option : options )
+				compiled->getPasses().configure(option);
+			compiled->setLazy(lazy);
+			if( kernels )
+				compiled->setKernels(*kernels);
+			return interp;
+		}else if( flags & Flag::Bits ) {
+			return std::unique_ptr<Brainfuck::Interpreter>(new Brainfuck::BitInterpreter( code, cell_n ));
+		}else if( flags & Flag::Ring ) {
+			return std::unique_ptr<Brainfuck::Interpreter>(new Brainfuck::RingInterpreter( code, cell_n ));
+		}else if( file != "" ) {
+			return std::unique_ptr<Brainfuck::Interpreter>(new Brainfuck::MappedInterpreter( code, file, cell_n ));
+		}else if( flags & Flag::Performance ) {
+			return std::unique_ptr<Brainfuck::Interpreter>(new Brainfuck::PerformanceInterpreter( code, cell_n ));
+		}
+		return std::unique_ptr<Brainfuck::Interpreter>(new Brainfuck::DynamicInterpreter( code ));
+	}
+};
+
+/// Print the value of all the cells
+void print( Brainfuck::Interpreter& interp ) {
+	std::vector<char> tape = interp.getTape();
+	std::cout << "Cell\tVal\tChar\n";
+	for(size_t i = 0; i < tape.size(); i++) {
+		std::cout << i << ":\t" << (int)(unsigned char)tape[i] << "\t'" << tape[i] << "'\n";
+	}
+	std::cout << std::endl;
+}
+
+/// Write whatever the program has output so far to stdout
+void flush( Brainfuck::Interpreter& interp ) {
+	std::cout << interp.getOutput();
+	interp.clearOutput();
+}
+
+/// Run the program from the start, as one stage of a pipe or on its own
+/// @param in Where to read input from, or nullptr for stdin, which is read a line at a time as the program asks for it
+/// @param out Where to write output to, or nullptr for stdout
+/// @param tape What to start the tape with, or nullptr to leave it blank
+/// @return The reason it stopped, which is only ever Ok or OutOfBounds
+Brainfuck::Status execute( Brainfuck::Interpreter& interp, ByteQueue* in = nullptr, ByteQueue* out = nullptr, Mapping* tape = nullptr ) {
+	Brainfuck::Status s;
+	// A tape kept in a file carries on from the last checkpoint, unless that program had already finished
+	Brainfuck::MappedInterpreter* mapped = dynamic_cast<Brainfuck::MappedInterpreter*>(&interp);
+	if( !mapped || !mapped->resume() || mapped->getPosition() >= mapped->getCode().length() ) {
+		interp.reset();
+		if( tape && (s = interp.setTape(tape->getData(), tape->getSize())) != Brainfuck::Status::Ok ) {
+			return s;
+		}
+	}
+	auto saved = std::chrono::steady_clock::now();
+	while( true ) {
+		s = interp.run(slice);
+		if( mapped && std::chrono::steady_clock::now() - saved > std::chrono::seconds(1) ) {
+			mapped->checkpoint();
+			saved = std::chrono::steady_clock::now();
+		}
+		if( !out ) {
+			flush(interp);
+		}else if( !out->write(interp.getOutput()) ) {
+			s = Brainfuck::Status::Ok; // The next stage has stopped, so there is no point carrying on
+			break;
+		}else {
+			interp.clearOutput();
+		}
+		if( s == Brainfuck::Status::NeedInput ) {
+			std::string line;
+			if( in ) {
+				in->read(line, chunk);
+			}else {
+				std::getline(std::cin, line);
 			}
+			// An empty line or the end of the input reads as a zero
+			interp.addInput(line.empty()? std::string(1, '\0') : line);
+		}else if( s != Brainfuck::Status::Budget ) {
+			break;
+		}
+	}
+	if( mapped )
+		mapped->checkpoint();
+	if( in )
+		in->close();
+	if( out )
+		out->finish();
+	else
+		std::cout << std::flush;
+	return s;
+}
+
+/// Run the program from the start with all of its input up front, for --parallel
+/// @return The reason it stopped, which is only ever Ok or OutOfBounds
+Brainfuck::Status batch( Brainfuck::Interpreter& interp, const std::string& input ) {
+	interp.reset();
+	interp.setInput(input);
+	Brainfuck::Status s;
+	while( (s = interp.run()) == Brainfuck::Status::NeedInput ) {
+		interp.addInput(std::string(1, '\0')); // The end of the input reads as a zero
+	}
+	return s;
+}
+
+/// Run every program on a pool of threads, and print how long each one took
+/// @param dir The directory to write each program's output to, or empty to print it with the program's name in front
+/// @return The exit code, which is 1 if any of them failed
+int parallel( Engine& engine, const std::vector<std::string>& paths, const std::vector<std::string>& codes, size_t jobs, const std::string& dir, bool timing ) {
+	// Every program gets a copy of stdin, which is only read if one of them needs it
+	std::string input = "";
+	for( const std::string& code : codes ) {
+		if( code.find(',') != std::string::npos ) {
 			std::stringstream buff;
-			buff << f.rdbuf();
-			this->code = buff.str();
+			buff << std::cin.rdbuf();
+			input = buff.str();
+			break;
 		}
+	}
 
-		/// Interprets the code form position 0
-		virtual void interpret() {
-			position = 0;
-			active_cell = 0;
+	// Files are named after the program, and expressions after where they were on the command line.
+	// Files with the same name, from different directories, get where they were on the command line as well
+	std::vector<std::string> names(codes.size());
+	std::map<std::string, size_t> uses;
+	std::set<std::string> taken;
+	for( size_t i = 0; i < codes.size(); i++ ) {
+		names[i] = std::to_string(i + 1);
+		if( !(engine.flags & Flag::Expression) ) {
+			names[i] = paths[i].substr(paths[i].find_last_of('/') + 1);
+			names[i] = names[i].substr(0, names[i].find_last_of('.'));
+			uses[names[i]]++;
+		}
+	}
+	for( size_t i = 0; i < codes.size(); i++ ) {
+		if( uses[names[i]] > 1 || taken.count(names[i]) ) {
+			names[i] += "." + std::to_string(i + 1);
+			// In case that is the name of another file, like a.2.bf
+			while( taken.count(names[i]) )
+				names[i] += "." + std::to_string(i + 1);
+		}
+		taken.insert(names[i]);
+	}
 
-			while( position < code.length() ) {
-				switch(code[position]) {
-					case '+':
-						bytes[active_cell]++;
-						break;
-					case '-':
-						bytes[active_cell]--;
-						break;
-					case '<': // This version has no hand holds
-						active_cell--;
-						break;
-					case '>':
-						active_cell++;
-						break;
-					case '[':
-						loops.push(position);
-						break;
-					case ']':
-						if(bytes[active_cell] == 0) {
-							loops.pop();
-						}else {
-							position = loops.top();
-						}
-						break;
-					case '.':
-						std::cout << (char)(bytes[active_cell]);
-						break;
-					case ',':
-						if(input.length() == 0) {
-							std::string i;
-							std::getline(std::cin, i);
-							input += i;
-						}
-						bytes[active_cell] = input[0];
-						input.erase(0,1);
-					case '#':
-						std::cout << "\nDebug:\n";
-						this->print();
-				}
-				position++;
+	std::vector<double> seconds(codes.size(), 0);
+	std::vector<std::string> results(codes.size(), "ok");
+	std::vector<std::string> reports(codes.size());
+	std::atomic<size_t> next{0};
+	std::mutex out;
+	auto worker = [&]() {
+		for( size_t i = next++; i < codes.size(); i = next++ ) {
+			const std::string& name = names[i];
+			std::string output;
+			auto start = std::chrono::steady_clock::now();
+			try {
+				std::unique_ptr<Brainfuck::Interpreter> interp = engine.build(codes[i]);
+				if( batch(*interp, input) == Brainfuck::Status::OutOfBounds )
+					results[i] = "The pointer went off the end of the tape";
+				output = interp->getOutput();
+				Brainfuck::CompiledInterpreter* compiled = dynamic_cast<Brainfuck::CompiledInterpreter*>(interp.get());
+				if( compiled && timing )
+					reports[i] = compiled->getPasses().report();
+			}catch( std::exception& e ) {
+				// Only thrown by --validate=strict, or a lazily compiled loop with no end
+				results[i] = e.what();
 			}
-		}
+			seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-		// Prints the contents of each cell
-		virtual void print() {
-			std::cout << "Cell\tVal\tChar\n";
-			for(size_t i = 0; i < size; i++) {
-				std::cout << i << ":\t" << (int)bytes[i] << "\t'" << bytes[i] << "'\n";
+			if( dir != "" ) {
+				std::ofstream file(dir + "/" + name + ".out", std::ios::binary);
+				file << output;
+				if( !file )
+					results[i] = "Could not write " + dir + "/" + name + ".out";
+				continue;
 			}
-			std::cout << std::endl;
+			// Written a whole program at a time, so the lines of different programs don't get mixed up
+			std::stringstream lines(output);
+			std::string line;
+			std::lock_guard<std::mutex> lock(out);
+			while( std::getline(lines, line) ) {
+				std::cout << name << ": " << line << "\n";
+			}
+			std::cout << std::flush;
 		}
 	};
+	std::vector<std::thread> threads;
+	for( size_t i = 1; i < std::min(jobs, codes.size()); i++ )
+		threads.emplace_back(worker);
+	worker();
+	for( std::thread& t : threads )
+		t.join();
+
+	int result = 0;
+	std::cerr << "Program\t\tTime (ms)\tResult\n";
+	for( size_t i = 0; i < codes.size(); i++ ) {
+		std::string name = (engine.flags & Flag::Expression)? std::to_string(i + 1) : paths[i];
+		std::cerr << name << (name.length() < 8? "\t\t" : "\t") << seconds[i] * 1000 << "\t\t" << results[i] << "\n";
+		if( results[i] != "ok" )
+			result = 1;
+	}
+	for( size_t i = 0; i < codes.size(); i++ ) {
+		if( reports[i] != "" )
+			std::cerr << "\n" << ((engine.flags & Flag::Expression)? std::to_string(i + 1) : paths[i]) << ":\n" << reports[i];
+	}
+	return result;
 }
 
-enum Flag {
-	Performance = 0b1,
-	Verbose = 0b10,
-	Expression = 0b100
-};
+/// Read the number following a flag, like the tape size after -p, if there is one
+size_t width( int argc, char** argv, int& i, size_t fallback = 256u ) {
+	if( i == argc - 1 ) {
+		return fallback;
+	}
+	std::string next = argv[i + 1];
+	// stoull would take "-1", and stop at the dot of "2.bf"
+	if( next == "" || next.find_first_not_of("0123456789") != std::string::npos ) {
+		return fallback;
+	}
+	try {
+		size_t s = std::stoull(next);
+		i++;
+		return s;
+	}catch( std::out_of_range& e ) {
+		return fallback;
+	}
+}
 
 int main( int argc, char** argv ) {
 
-	int flags = 0;
-	size_t cell_n = 256u;
-	std::string path = "";
-	for( int i = 0; i < argc; i++ ) {
+	Engine engine;
+	std::vector<std::string> paths;
+	bool timing = false;
+	size_t jobs = 1;
+	std::string dir = "";
+	std::string tape_in = "";
+	std::string tape_out = "";
+	for( int i = 1; i < argc; i++ ) {
 		std::string arg = argv[i];
 		if( arg == "-p" || arg == "--performance" ) {
-			flags |= Flag::Performance; // Enable the performance flag
-			try {
-				if( i == argc - 1 ) {
-					cell_n = 256u; // Default to 256 cells
-				}else {
-					std::string next_arg = argv[i + 1];
-					size_t s = std::stoull(next_arg);
-					cell_n = s;
-					i++;
-				}
-			}catch( std::invalid_argument e ) {
-				cell_n = 256u;
-			}
+			engine.flags |= Flag::Performance; // Enable the performance flag
+			engine.cell_n = width(argc, argv, i);
+		}else if( arg == "-c" || arg == "--compiled" ) {
+			engine.flags |= Flag::Compiled;
+			engine.cell_n = width(argc, argv, i);
+		}else if( arg == "-r" || arg == "--ring" ) {
+			engine.flags |= Flag::Ring;
+			engine.cell_n = width(argc, argv, i);
+		}else if( arg == "-b" || arg == "--bits" ) {
+			engine.flags |= Flag::Bits;
+			engine.cell_n = width(argc, argv, i);
 		}else if( arg == "-v" || arg == "--verbose" ) {
-			flags |= Flag::Verbose;
+			engine.flags |= Flag::Verbose;
 		}else if( arg == "-e" || arg == "--eval" ) {
-			flags |= Flag::Expression;
+			engine.flags |= Flag::Expression;
+		}else if( arg == "--pipe" ) {
+			engine.flags |= Flag::Pipe;
+		}else if( arg == "--parallel" ) {
+			engine.flags |= Flag::Parallel;
+			jobs = width(argc, argv, i, std::max(std::thread::hardware_concurrency(), 1u));
+		}else if( arg.compare(0, 10, "--out-dir=") == 0 ) {
+			dir = arg.substr(10);
+		}else if( arg.compare(0, 10, "--kernels=") == 0 ) {
+			try {
+				engine.kernels = &Brainfuck::Kernels::find(arg.substr(10));
+			}catch( std::invalid_argument& e ) {
+				std::cerr << "Error: " << e.what() << std::endl;
+				return 1;
+			}
+		}else if( arg == "--tape-file" && i < argc - 1 ) {
+			engine.flags |= Flag::Performance; // Only the performance interpreter can keep its tape in a file
+			engine.file = argv[++i];
+		}else if( (arg == "--tape-in" || arg == "--tape-out") && i < argc - 1 ) {
+			(arg == "--tape-in"? tape_in : tape_out) = argv[++i];
+		}else if( arg == "--no-lazy" ) {
+			engine.lazy = false;
 		}else if( arg == "-h" || arg == "--help") {
-			std::cout << "Usage:\nquickfuck <file> --flags\n\tFlags:\n\t--performance (-p): Uses the performance interpreter. Specify the size of the tape with a following argument, ex: '-p 32'\n\t--verbose (-v): Show contents of cells after evaluation ends. Also consider using '#' in code\n\t--eval (-e): Switches from file interpretation to interpreting code" << std::endl;
+			std::cout << "Usage:\nquickfuck <file> --flags\n\tFlags:\n\t--performance (-p): Uses the performance interpreter. Specify the size of the tape with a following argument, ex: '-p 32'\n\t--compiled (-c): Uses the compiled interpreter, which optimises the code first. Takes a tape size like '-p'\n\t--ring (-r): Uses a performance interpreter whose tape wraps around at the ends. Takes a tape size like '-p', which is rounded up to a power of two\n\t--bits (-b): Runs Boolfuck instead, where each cell is one bit. Takes a tape size like '-p', in bits\n\t--verbose (-v): Show contents of cells after evaluation ends. Also consider using '#' in code\n\t--eval (-e): Switches from file interpretation to interpreting code\n\t--pipe: Runs every file or expression given at once, each feeding its output to the next one's input\n\t--parallel: Runs every file or expression given on their own, on a thread per core. Specify how many threads with a following argument, ex: '--parallel 4'\n\t--out-dir=<dir>: With --parallel, writes each program's output to a file in dir instead of printing it\n\t--tape-in <file>: Starts the tape with the contents of a file\n\t--tape-out <file>: Writes the tape to a file afterwards, one byte per cell\n\t--tape-file <file>: Keeps the tape of the performance interpreter in a file, so it can be bigger than memory, and carries on from where it got to if it is stopped and run again\n\tWith --compiled:\n\t-O0 to -O3: Optimisation level, defaults to -O2\n\t-f<pass>, -fno-<pass>: Turn a single pass on or off\n\t--time-passes: Show the time spent in each pass afterwards\n\t--validate, --validate=strict: Check the optimised code against the original\n\t--rules=<file>: Load rewrite rules from a file\n\t--kernels=<name>: Use the scalar, sse2, avx2 or avx512 kernels\n\t--no-lazy: Compile the whole program before running it" << std::endl;
 			return 0;
 		}else {
-			path = argv[i];
+			try {
+				// Checked here, so a bad option is reported before anything runs
+				if( Brainfuck::PassManager().configure(arg) ) {
+					engine.options.push_back(arg);
+					timing |= arg == "--time-passes";
+				}else {
+					paths.push_back(arg);
+				}
+			}catch( std::invalid_argument& e ) {
+				std::cerr << "Error: " << e.what() << std::endl;
+				return 1;
+			}
 		}
 	}
+	int flags = engine.flags;
 
-	if( path == "" ) {
-		std::cerr << "Error: " << ((flags & Flag::Expression)? "expression":"path") << "Cannot be empty" << std::endl;
+	if( paths.empty() ) {
+		std::cerr << "Error: " << ((flags & Flag::Expression)? "expression":"path") << " cannot be empty" << std::endl;
+		return 1;
+	}
+	if( (flags & Flag::Pipe) && (flags & Flag::Parallel) ) {
+		std::cerr << "Error: --pipe and --parallel cannot be used together" << std::endl;
+		return 1;
+	}
+	if( (flags & (Flag::Pipe | Flag::Parallel)) && (tape_in != "" || tape_out != "" || engine.file != "") ) {
+		std::cerr << "Error: --tape-in, --tape-out and --tape-file only work with a single program" << std::endl;
 		return 1;
 	}
-	std::string code = "";
-	if( flags & Flag::Expression ) {
-		code = path;
-	}else {
-		std::ifstream file(path);
-		if(!file) {
-			std::cerr << "Error: File " << path << " not found" << std::endl;
+	if( (flags & (Flag::Compiled | Flag::Ring | Flag::Bits)) && engine.file != "" ) {
+		std::cerr << "Error: --tape-file only works with the performance interpreter" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<Mapping> tape;
+	if( tape_in != "" ) {
+		try {
+			tape.reset(new Mapping(tape_in));
+		}catch( std::runtime_error& e ) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return 1;
+		}
+		if( (flags & (Flag::Performance | Flag::Compiled | Flag::Ring | Flag::Bits)) && tape->getSize() > engine.cell_n ) {
+			std::cerr << "Error: " << tape_in << " is bigger than the tape, which has " << engine.cell_n << " cells" << std::endl;
 			return 1;
 		}
-		std::stringstream buff;
-		buff << file.rdbuf();
-		code = buff.str();
+		// The tape doesn't start out blank any more
+		engine.options.erase(std::remove(engine.options.begin(), engine.options.end(), "--zero-tape"), engine.options.end());
 	}
-	if( code == "" ) {
-		std::cerr << "Error: No code to evaluate" << std::endl;
-		return 1;
+	// Without --pipe or --parallel, only the last one runs
+	if( !(flags & (Flag::Pipe | Flag::Parallel)) ) {
+		paths.erase(paths.begin(), paths.end() - 1);
+	}
+	std::vector<std::string> codes;
+	for( const std::string& path : paths ) {
+		std::string code = "";
+		if( flags & Flag::Expression ) {
+			code = path;
+		}else {
+			std::ifstream file(path);
+			if(!file) {
+				std::cerr << "Error: File " << path << " not found" << std::endl;
+				return 1;
+			}
+			std::stringstream buff;
+			buff << file.rdbuf();
+			code = buff.str();
+		}
+		if( code == "" ) {
+			std::cerr << "Error: No code to evaluate" << std::endl;
+			return 1;
+		}
+		codes.push_back(code);
 	}
 
-	Brainfuck::Interpreter* interp;
-	if( flags & Flag::Performance ) {
-		if( flags & Flag::Verbose )
+	if( flags & Flag::Verbose ) {
+		if( flags & Flag::Compiled )
+			std::cout << "Compiled Mode" << std::endl;
+		else if( flags & Flag::Bits )
+			std::cout << "Bit Mode" << std::endl;
+		else if( flags & Flag::Ring )
+			std::cout << "Ring Mode" << std::endl;
+		else if( flags & Flag::Performance )
 			std::cout << "Performance Mode" << std::endl;
-		interp = new Brainfuck::PerformanceInterpreter( code, cell_n );
-	}else {
-		if( flags & Flag::Verbose )
+		else
 			std::cout << "Dynamic Mode" << std::endl;
-		interp = new Brainfuck::DynamicInterpreter( code );
 	}
-	interp->interpret();
+	if( flags & Flag::Parallel ) {
+		return parallel(engine, paths, codes, jobs, dir, timing);
+	}
+	std::vector<std::unique_ptr<Brainfuck::Interpreter>> interps;
+	std::vector<std::unique_ptr<ByteQueue>> queues;
+	for( size_t i = 0; i < codes.size(); i++ ) {
+		try {
+			interps.push_back(engine.build(codes[i]));
+		}catch( std::exception& e ) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return 1;
+		}
+		if( i > 0 )
+			queues.emplace_back(new ByteQueue());
+	}
+	// Only hook '#' when there is one, so the compiled interpreter doesn't have to stop for it
+	// Stages of a pipe would print over each other, so it is left alone there
+	if( interps.size() == 1 && codes[0].find('#') != std::string::npos ) {
+		interps[0]->setDebugHook( []( Brainfuck::Interpreter& i ) {
+			flush(i);
+			std::cout << "\nDebug:\n";
+			print(i);
+			return false;
+		} );
+	}
+
+	// Every stage but the last runs on a thread of its own
+	std::vector<Brainfuck::Status> status(interps.size(), Brainfuck::Status::Ok);
+	std::vector<std::string> errors(interps.size());
+	auto stage = [&]( size_t i ) {
+		ByteQueue* in = i > 0? queues[i - 1].get() : nullptr;
+		ByteQueue* out = i < queues.size()? queues[i].get() : nullptr;
+		try {
+			status[i] = execute(*interps[i], in, out, tape.get());
+		}catch( std::exception& e ) {
+			// Only thrown by --validate=strict, or a lazily compiled loop with no end
+			errors[i] = e.what();
+			if( in )
+				in->close();
+			if( out )
+				out->finish();
+		}
+	};
+	std::vector<std::thread> threads;
+	for( size_t i = 0; i + 1 < interps.size(); i++ )
+		threads.emplace_back(stage, i);
+	stage(interps.size() - 1);
+	for( std::thread& t : threads )
+		t.join();
 	std::cout << std::endl;
-	if( flags & Flag::Verbose )
-		interp->print();
-}
\ No newline at end of file
+
+	int result = 0;
+	for( size_t i = 0; i < interps.size(); i++ ) {
+		std::string where = interps.size() > 1? " in " + paths[i] : "";
+		if( errors[i] != "" ) {
+			std::cerr << "Error" << where << ": " << errors[i] << std::endl;
+			result = 1;
+		}else if( status[i] == Brainfuck::Status::OutOfBounds ) {
+			std::cerr << "Error" << where << ": The pointer went off the end of the tape" << std::endl;
+			result = 1;
+		}
+		Brainfuck::CompiledInterpreter* compiled = dynamic_cast<Brainfuck::CompiledInterpreter*>(interps[i].get());
+		if( compiled && timing )
+			std::cerr << compiled->getPasses().report();
+		if( flags & Flag::Verbose )
+			print(*interps[i]);
+	}
+	if( tape_out != "" && errors[0] == "" && !dump(*interps[0], tape_out) ) {
+		std::cerr << "Error: Could not write " << tape_out << std::endl;
+		result = 1;
+	}
+	return result;
+}